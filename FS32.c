@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 
 #include "FS32_internals.h"
 
@@ -29,21 +30,295 @@ static uint32_t StartOfPartition;
 #endif
 static uint16_t RsvdSecCnt; //number of reserved sectors == first sector of FAT
 static uint32_t FATSz32; //number of sectors for one FAT
+#if FAT_MIRROR
+static bool FATMirrorEnabled; //the volume has a second FAT that needs to be kept up to date
+static bool FATMirrorPending; //at least one bit of FATMirrorDirty is set
+static uint32_t FATMirrorGroupSectors; //number of FAT sectors covered by one bit of FATMirrorDirty
+static uint8_t FATMirrorDirty[FS32_FAT_MIRROR_BITMAP_BYTES]; //groups of FAT sectors changed since they were last copied to the second FAT
+#endif
 static uint32_t RootSector; //sector where the root dir is
 static uint32_t FirstDataSector;
 static uint32_t TotalNbOfDataSectors;
-static uint8_t FATIndexLastEntry;
+static uint32_t FATSectorLastEntry; //FAT sector containing the entry of the last cluster
+static fat_entry_index_t FATIndexLastEntry; //index of this entry inside this FAT sector
 static fat32_entry_t EndOfClusterChainMarker;
 static uint32_t NbFreeSectors;
 static uint32_t LastAllocatedSector;
+#if FS32_ALLOCATION_UNIT_SECTORS
+static uint32_t FreeAUSearchPos; //AU to check first when looking for an entirely free one, the AUs checked before it were not free
+static bool NoFreeAU; //all AUs were checked and none was free, nothing to look for until clusters are freed
+#endif
+#if FS32_REALTIME_WRITE
+static bool FSInfoDirty; //FSINFO is only updated by f_close() and f_idle_step() in this mode
+#endif
+#if FS32_IDLE_STEP_SUPPORT
+static uint32_t FreeClusterCache[FS32_FREE_CLUSTER_CACHE_SIZE]; //ring buffer of free clusters found by f_idle_step(), in allocation order
+static uint8_t FreeClusterCacheHead;
+static uint8_t FreeClusterCacheCount;
+static uint32_t FreeClusterCacheScanPos; //next cluster to look at for refilling the cache
+static uint32_t FreeClusterCacheScanIdle; //FAT sectors scanned without finding anything, used to detect a wrong free count
+static uint32_t RecountSector; //next FAT sector to count for verifying NbFreeSectors, 0 if done
+static uint32_t RecountNbFree; //free clusters in FAT sectors before RecountSector
+#endif
+#if FS32_NAME_INDEX_SUPPORT || FS32_SNAPSHOT_SUPPORT
+static uint32_t VolumeID;
+#endif
+#if FS32_NAME_INDEX_SUPPORT
+static uint32_t NameIndexFirstCluster; //first cluster of FS32IDX.SYS (the header), 0 if there is no valid index
+#endif
+#if FS32_SNAPSHOT_SUPPORT
+static uint32_t SnapshotSector; //reserved sector for the allocation snapshot, 0 if there is none
+static uint32_t SnapshotGroupSectors; //number of FAT sectors in one group of GroupFree
+static uint16_t GroupFree[FS32_SNAPSHOT_GROUPS]; //free clusters in each group of FAT sectors, saturated at SNAPSHOT_GROUP_MANY
+#endif
+#if FS32_SUBDIR_SUPPORT
+static dir_cache_entry_t DirCache[FS32_DIR_CACHE_SIZE]; //resolved sub-directories, Cluster==0 if unused
+static uint8_t DirCacheNext; //entry to replace next
+#endif
 static file_t OpenFiles[FS32_NB_FILES_MAX];
+#if FS32_RECORD_SUPPORT
+static record_map_t RecordMaps[FS32_NB_FILES_MAX]; //extent tables of the files opened by f_open_records()
+#endif
+#if !SINGLE_FILE_CONFIG
+static uint8_t FreeSlotHead; //first slot of the list of free slots, linked by file_t.Next
+#endif
+#if OPEN_FILES_HASHED
+static uint8_t OpenFilesHash[FS32_NB_FILES_MAX]; //first opened file of each bucket, linked by file_t.Next
+#endif
 
-static uint8_t Buffer[512];
+static uint8_t Buffer[FS32_SECTOR_SIZE];
+#if FS32_CONCAT_SUPPORT || FS32_COMPACT_ROOT_SUPPORT || FS32_NAME_INDEX_SUPPORT
+static uint8_t SecondBuffer[FS32_SECTOR_SIZE]; //for f_concat() of a file whose size is not a multiple of the sector size, f_compact_root() and f_index_rebuild()
+#endif
+
+#if FS32_WRITEBACK_SECTORS
+static writeback_entry_t WritebackQueue[FS32_WRITEBACK_SECTORS]; //Class==WB_CLASS_FREE if unused
+static uint8_t WritebackData[FS32_WRITEBACK_SECTORS][FS32_SECTOR_SIZE];
+static uint8_t WritebackCount;
+#endif
 
 #define IS_EOC_MARKER(value) (value>=0x0FFFFFF8 && value<=0x0FFFFFFF)
 
 #define LOGICAL_SECTOR_TO_PHYSICAL(datasector) ((datasector-2)+FirstDataSector)
 
+//SWAR (SIMD within a register) helpers for scanning an entire FAT sector: A lane holds a single entry masked to 28 bits, adding 0x0FFFFFFF to it sets bit 28 if (and only if) the entry is not zero. There is no carry into the next lane. On 8/16-bit targets a lane is the whole word so this is just the usual masked compare.
+#if UINTPTR_MAX>0xFFFF
+typedef uint64_t fat32_swar_t;
+#define FAT_SWAR_MASK 0x0FFFFFFF0FFFFFFFULL
+#define FAT_SWAR_FLAG 0x1000000010000000ULL
+#else
+typedef uint32_t fat32_swar_t;
+#define FAT_SWAR_MASK 0x0FFFFFFFUL
+#define FAT_SWAR_FLAG 0x10000000UL
+#endif
+#define FAT_SWAR_LANES (sizeof(fat32_swar_t)/sizeof(fat32_entry_t))
+
+static inline fat32_swar_t fat32_swar_free_flags(uint8_t const * const sector, const fat_entry_index_t index)
+{
+	fat32_swar_t v;
+	memcpy(&v, sector+index*sizeof(fat32_entry_t), sizeof(fat32_swar_t));
+	return ~((v&FAT_SWAR_MASK)+FAT_SWAR_MASK)&FAT_SWAR_FLAG;
+}
+
+#if !FS32_NO_APPEND || !FS32_NO_WRITE
+//returns the index of the first free entry >=index or -1
+static int16_t fat32_find_free_entry_in_sector(uint8_t const * const sector, const fat_entry_index_t index, const fat_entry_index_t nb_entries)
+{
+	fat_entry_index_t i=index-(index%FAT_SWAR_LANES);
+	fat32_swar_t skip=(((fat32_swar_t)1)<<(32*(index%FAT_SWAR_LANES)))-1; //lanes before index inside the first word
+	
+	for(; i<nb_entries; i+=FAT_SWAR_LANES)
+	{
+		fat32_swar_t flags=fat32_swar_free_flags(sector, i)&~skip;
+		skip=0;
+		if(flags)
+		{
+			if(!(flags&0x10000000UL))
+				i++;
+			return (i<nb_entries)?i:-1;
+		}
+	}
+	
+	return -1;
+}
+#endif
+
+#if FS32_RECOUNT_FREE_ON_INIT || FS32_IDLE_STEP_SUPPORT || FS32_ALLOCATION_UNIT_SECTORS || FS32_DEFRAG_SUPPORT || FS32_NAME_INDEX_SUPPORT || FS32_SNAPSHOT_SUPPORT
+static fat_entry_index_t fat32_count_free_entries_in_sector(uint8_t const * const sector, const fat_entry_index_t nb_entries)
+{
+	fat32_swar_t acc=0;
+	fat_entry_index_t i;
+	
+	for(i=0; i+FAT_SWAR_LANES<=nb_entries; i+=FAT_SWAR_LANES)
+		acc+=fat32_swar_free_flags(sector, i)>>28; //one counter per lane
+	
+	for(; i<nb_entries; i++)
+	{
+		if((((fat32_entry_t*)sector)[i]&0x0FFFFFFF)==0x00000000)
+			acc++;
+	}
+	
+#if UINTPTR_MAX>0xFFFF
+	return (acc&0xFFFFFFFF)+(acc>>32);
+#else
+	return acc;
+#endif
+}
+#endif
+
+#if !FS32_NO_APPEND || !FS32_NO_WRITE || FS32_RECOUNT_FREE_ON_INIT || FS32_IDLE_STEP_SUPPORT
+//number of entries inside a FAT sector that belong to an existing cluster
+static fat_entry_index_t fat32_nb_entries_in_sector(const uint32_t sector)
+{
+	if(sector==FATSectorLastEntry)
+		return FATIndexLastEntry+1;
+	else
+		return FAT_ENTRIES_PER_SECTOR;
+}
+#endif
+
+#if FS32_WRITEBACK_SECTORS
+//returns the entry of the write-back queue holding sector or -1
+static int16_t writeback_find(const uint32_t sector)
+{
+	uint8_t i;
+	for(i=0; i<FS32_WRITEBACK_SECTORS; i++)
+	{
+		if(WritebackQueue[i].Class!=WB_CLASS_FREE && WritebackQueue[i].Sector==sector)
+			return i;
+	}
+	
+	return -1;
+}
+
+//Write the whole queue to the card class by class, inside a class sorted by sector number. FAT sectors are written from the end: chains usually grow towards higher clusters, a power loss while flushing leaves new clusters allocated but not linked instead of a link to a free cluster.
+static void writeback_flush(void)
+{
+	uint8_t Class;
+	
+	for(Class=WB_CLASS_DATA; Class<=WB_CLASS_RESERVED && WritebackCount; Class++)
+	{
+		while(1)
+		{
+			int16_t First=-1;
+			uint8_t i;
+			for(i=0; i<FS32_WRITEBACK_SECTORS; i++)
+			{
+				if(WritebackQueue[i].Class!=Class)
+					continue;
+				
+				if(First<0 || (Class==WB_CLASS_FAT)==(WritebackQueue[i].Sector>WritebackQueue[First].Sector))
+					First=i;
+			}
+			
+			if(First<0)
+				break;
+			
+			uint32_t Sector=WritebackQueue[First].Sector;
+			
+#if FS32_MULTI_BLOCK_WRITE
+			int16_t Entry=writeback_find(Sector+1);
+			if(Class!=WB_CLASS_FAT && Entry>=0 && WritebackQueue[Entry].Class==Class) //a multi block write can't go downwards
+			{
+				//a single multi block write for the whole run
+				Entry=First;
+				SD_WRITE_MULTIPLE_SECTORS_START(Sector);
+				do
+				{
+					sd_write_multiple_sectors_next(WritebackData[Entry]);
+					WritebackQueue[Entry].Class=WB_CLASS_FREE;
+					WritebackCount--;
+					Entry=writeback_find(++Sector);
+				} while(Entry>=0 && WritebackQueue[Entry].Class==Class);
+				sd_write_multiple_sectors_stop();
+				continue;
+			}
+#endif
+			
+			SD_WRITE_SECTOR_NOW(Sector, WritebackData[First]);
+			WritebackQueue[First].Class=WB_CLASS_FREE;
+			WritebackCount--;
+		}
+	}
+}
+
+//Nothing written from now on may reach the card before the queued sectors of a higher class (for example freeing clusters before the directory entry is removed), flush if there are any. FSINFO is only a hint and can always be written last.
+static void writeback_barrier(const uint8_t class)
+{
+	uint8_t i;
+	for(i=0; i<FS32_WRITEBACK_SECTORS; i++)
+	{
+		if(WritebackQueue[i].Class>class && WritebackQueue[i].Class!=WB_CLASS_RESERVED)
+		{
+			writeback_flush();
+			return;
+		}
+	}
+}
+
+static void writeback_read(const uint32_t sector, uint8_t * const data)
+{
+	int16_t Entry=writeback_find(sector);
+	if(Entry>=0)
+		memcpy(data, WritebackData[Entry], FS32_SECTOR_SIZE);
+	else
+		SD_READ_SECTOR_NOW(sector, data);
+}
+
+static void writeback_write(const uint32_t sector, uint8_t const * const data, uint8_t class)
+{
+	if(class==WB_CLASS_AUTO)
+	{
+		if(sector<RsvdSecCnt)
+			class=WB_CLASS_RESERVED;
+		else if(sector<FirstDataSector)
+			class=WB_CLASS_FAT;
+		else
+			class=WB_CLASS_DATA;
+	}
+	
+	if(class!=WB_CLASS_DATA) //writing data earlier than issued is always safe, it is not referenced yet or only overwritten
+		writeback_barrier(class);
+	
+	int16_t Entry=writeback_find(sector);
+	if(Entry<0)
+	{
+		if(WritebackCount==FS32_WRITEBACK_SECTORS)
+			writeback_flush();
+		
+		for(Entry=0; WritebackQueue[Entry].Class!=WB_CLASS_FREE; Entry++);
+		
+		WritebackQueue[Entry].Sector=sector;
+		WritebackQueue[Entry].Class=class;
+		WritebackCount++;
+	}
+	else if(class>WritebackQueue[Entry].Class) //a freed data cluster reused for a directory
+		WritebackQueue[Entry].Class=class;
+	
+	memcpy(WritebackData[Entry], data, FS32_SECTOR_SIZE);
+}
+
+#if FS32_DISCARD_SUPPORT
+//the data of freed clusters does not need to be written anymore, but the directory entry must be removed from the card before the data is gone
+static void writeback_discard(const uint32_t sector, const uint32_t count)
+{
+	writeback_barrier(WB_CLASS_FAT);
+	
+	uint8_t i;
+	for(i=0; i<FS32_WRITEBACK_SECTORS; i++)
+	{
+		if(WritebackQueue[i].Class!=WB_CLASS_FREE && WritebackQueue[i].Sector-sector<count)
+		{
+			WritebackQueue[i].Class=WB_CLASS_FREE;
+			WritebackCount--;
+		}
+	}
+	
+	SD_DISCARD_SECTORS_NOW(sector, count);
+}
+#endif
+#endif
+
 #if !FS32_NO_APPEND || !FS32_NO_WRITE
 static void update_fsinfo(void)
 {
@@ -52,14 +327,87 @@ static void update_fsinfo(void)
 	fsinfo->FSI_Free_Count=NbFreeSectors;
 	fsinfo->FSI_Last_Allocated=LastAllocatedSector;
 	SD_WRITE_SECTOR(1, Buffer);
+#if FS32_REALTIME_WRITE
+	FSInfoDirty=false;
+#endif
+}
+#endif
+
+#if FS32_SNAPSHOT_SUPPORT
+static uint16_t * group_free_of(const uint32_t fat_sector)
+{
+	return &GroupFree[(fat_sector-RsvdSecCnt)/SnapshotGroupSectors];
+}
+
+//a cluster whose entry is in fat_sector was allocated
+static void group_free_dec(const uint32_t fat_sector)
+{
+	uint16_t * const Count=group_free_of(fat_sector);
+	if(!(*Count))
+		(*Count)=SNAPSHOT_GROUP_MANY; //the count was wrong, unknown from now on
+	else if((*Count)!=SNAPSHOT_GROUP_MANY)
+		(*Count)--;
+}
+
+#if !FS32_NO_UNLINK || !FS32_NO_TRUNCATE || FS32_DEFRAG_SUPPORT || FS32_CONCAT_SUPPORT || FS32_COMPACT_ROOT_SUPPORT || FS32_NAME_INDEX_SUPPORT || FS32_SUBDIR_SUPPORT
+//a cluster whose entry is in fat_sector was freed
+static void group_free_inc(const uint32_t fat_sector)
+{
+	uint16_t * const Count=group_free_of(fat_sector);
+	if((*Count)!=SNAPSHOT_GROUP_MANY)
+		(*Count)++;
+}
+#endif
+
+static uint32_t snapshot_checksum(uint8_t const * const sector)
+{
+	uint32_t Sum=0;
+	uint16_t i;
+	
+	for(i=0; i<sizeof(fs32_snapshot_t)-sizeof(uint32_t); i+=sizeof(uint32_t))
+	{
+		uint32_t Word;
+		memcpy(&Word, sector+i, sizeof(uint32_t));
+		Sum=((Sum<<1)|(Sum>>31))+Word;
+	}
+	
+	return Sum;
+}
+
+//Replaces the free counts of the groups by the snapshot if it was written by f_unmount() and the card was not changed since, NbFreeSectors and LastAllocatedSector must already be loaded from FSINFO. The snapshot is marked as dirty.
+static bool snapshot_load(void)
+{
+	memset(GroupFree, 0xFF, sizeof(GroupFree)); //SNAPSHOT_GROUP_MANY
+	
+	if(!SnapshotSector)
+		return false;
+	
+	SD_READ_SECTOR(SnapshotSector, Buffer);
+	fs32_snapshot_t * const Snapshot=(fs32_snapshot_t*)Buffer;
+	
+	if(Snapshot->Magic!=SNAPSHOT_MAGIC || Snapshot->State!=SNAPSHOT_STATE_CLEAN || Snapshot->Checksum!=snapshot_checksum(Buffer))
+		return false;
+	
+	//card was formatted again, FS32_SNAPSHOT_GROUPS was changed or a PC wrote to it (and updated FSINFO)?
+	bool Valid=(Snapshot->VolumeID==VolumeID && Snapshot->GroupSectors==SnapshotGroupSectors && Snapshot->NbFreeSectors==NbFreeSectors && Snapshot->LastAllocatedSector==LastAllocatedSector);
+	
+	if(Valid)
+		memcpy(GroupFree, Snapshot->GroupFree, sizeof(GroupFree));
+	
+	//the snapshot will be outdated soon, this must reach the card before anything else is changed
+	Snapshot->State=SNAPSHOT_STATE_DIRTY;
+	Snapshot->Checksum=snapshot_checksum(Buffer);
+	SD_WRITE_SECTOR_NOW(SnapshotSector, Buffer);
+	
+	return Valid;
 }
 #endif
 
 static pos_fat32_entry_t get_pos_fat_entry(const uint32_t sector)
 {	
 	pos_fat32_entry_t p;
-	p.FAT_SectorNumber=RsvdSecCnt+(sector/128);
-	p.FAT_EntryIndex=sector%128;
+	p.FAT_SectorNumber=RsvdSecCnt+(sector>>FAT_ENTRIES_SHIFT);
+	p.FAT_EntryIndex=sector&(FAT_ENTRIES_PER_SECTOR-1);
 	
 	return p;
 }
@@ -71,11 +419,88 @@ static fat32_entry_t fat32_read_entry(pos_fat32_entry_t const * const pos)
 }
 
 #if !FS32_NO_APPEND || !FS32_NO_WRITE
+//all writes to the (first) FAT go through here so we know what to copy to the second FAT
+static void fat32_write_fat_sector(const uint32_t sector, uint8_t const * const data)
+{
+	SD_WRITE_SECTOR(sector, data);
+#if FAT_MIRROR
+	if(FATMirrorEnabled)
+	{
+		uint16_t Group=(sector-RsvdSecCnt)/FATMirrorGroupSectors;
+		FATMirrorDirty[Group/8]|=(1<<(Group%8));
+		FATMirrorPending=true;
+	}
+#endif
+}
+
+#if !FS32_NO_WRITE
 static void fat32_write_entry(pos_fat32_entry_t const * const pos, const uint32_t nextSector)
 {
 	SD_READ_SECTOR(pos->FAT_SectorNumber, Buffer);
 	((fat32_entry_t*)Buffer)[pos->FAT_EntryIndex]=nextSector;
-	SD_WRITE_SECTOR(pos->FAT_SectorNumber, Buffer);
+	fat32_write_fat_sector(pos->FAT_SectorNumber, Buffer);
+}
+#endif
+
+//mark new as end of chain and link curr to it, a single read-modify-write if both entries are in the same FAT sector
+static void fat32_append_cluster(pos_fat32_entry_t const * const p_curr, pos_fat32_entry_t const * const p_new)
+{
+	SD_READ_SECTOR(p_new->FAT_SectorNumber, Buffer);
+	((fat32_entry_t*)Buffer)[p_new->FAT_EntryIndex]=EndOfClusterChainMarker;
+	
+	if(p_curr->FAT_SectorNumber!=p_new->FAT_SectorNumber)
+	{
+		fat32_write_fat_sector(p_new->FAT_SectorNumber, Buffer);
+		SD_READ_SECTOR(p_curr->FAT_SectorNumber, Buffer);
+	}
+	
+	((fat32_entry_t*)Buffer)[p_curr->FAT_EntryIndex]=p_new->LogicalSector;
+	fat32_write_fat_sector(p_curr->FAT_SectorNumber, Buffer);
+}
+#endif
+
+#if FAT_MIRROR
+//copy the changed groups of FAT sectors to the second FAT in ascending order, consecutive dirty groups become a single run of sequential writes. A group is only copied if all its sector accesses fit into the budget. Returns the number of sector accesses done.
+static uint32_t fat32_mirror_sync(const uint32_t budget_sectors)
+{
+	uint32_t NbSectorsUsed=0;
+	uint32_t Group;
+	
+	if(!FATMirrorPending)
+		return 0;
+	
+	for(Group=0; Group<8*FS32_FAT_MIRROR_BITMAP_BYTES; Group++)
+	{
+		if(!FATMirrorDirty[Group/8])
+		{
+			Group|=7; //skip the whole byte
+			continue;
+		}
+		
+		if(!(FATMirrorDirty[Group/8]&(1<<(Group%8))))
+			continue;
+		
+		uint32_t Sector=RsvdSecCnt+Group*FATMirrorGroupSectors;
+		uint32_t End=Sector+FATMirrorGroupSectors;
+		if(End>FATSectorLastEntry+1) //the rest of the FAT is never written
+			End=FATSectorLastEntry+1;
+		
+		if(NbSectorsUsed+2*(End-Sector)>budget_sectors)
+			return NbSectorsUsed;
+		
+		for(; Sector<End; Sector++)
+		{
+			SD_READ_SECTOR(Sector, Buffer);
+			SD_WRITE_SECTOR(Sector+FATSz32, Buffer);
+			NbSectorsUsed+=2;
+		}
+		
+		FATMirrorDirty[Group/8]&=~(1<<(Group%8));
+	}
+	
+	FATMirrorPending=false;
+	
+	return NbSectorsUsed;
 }
 #endif
 
@@ -102,6 +527,16 @@ static void write_logical_sector(const uint32_t sector, uint8_t const * const da
 	uint32_t Physical=LOGICAL_SECTOR_TO_PHYSICAL(sector);
 	SD_WRITE_SECTOR(Physical, data);
 }
+
+//for sectors of a directory, they are written after data and FAT by the write-back queue
+static void write_dir_sector(const uint32_t sector, uint8_t const * const data)
+{
+#if FS32_WRITEBACK_SECTORS
+	writeback_write(LOGICAL_SECTOR_TO_PHYSICAL(sector), data, WB_CLASS_DIR);
+#else
+	write_logical_sector(sector, data);
+#endif
+}
 #endif
 
 void fat32_filename_to_string(fat32_directory_entry_t const * const entry, char * const string)
@@ -118,607 +553,2658 @@ void fat32_filename_to_string(fat32_directory_entry_t const * const entry, char
 	string[j]='\0';
 }
 
-void filename_to_fat32(uint8_t filenr, fat32_directory_entry_t * const entry)
+//name as stored in a directory entry (8+3 characters padded with spaces, no dot), stops at the end of a path component
+static void filename_to_raw(char const * const filename, char * const raw)
 {
-#if SINGLE_FILE_CONFIG
-	(void)filenr;
-#endif
-	
-	memset(entry->DIR_Name, ' ', 8);
-	memset(entry->DIR_Ext, ' ', 3);
+	memset(raw, ' ', 8+3);
 	
 	uint8_t i,j;
-	for(i=0, j=0; OpenFiles[FILENR_ARR_INDEX].Name[i] && OpenFiles[FILENR_ARR_INDEX].Name[i]!='.'; i++, j++)
-		entry->DIR_Name[j]=OpenFiles[FILENR_ARR_INDEX].Name[i];
-	if(OpenFiles[FILENR_ARR_INDEX].Name[i])
+	for(i=0; i<2 && filename[i]=='.'; i++) //"." and ".." of a sub-directory
+		raw[i]='.';
+	for(j=i; filename[i] && filename[i]!='.' && filename[i]!='/'; i++)
+	{
+		if(j<8)
+			raw[j++]=filename[i];
+	}
+	if(filename[i]=='.')
+	{
+		for(i++, j=8; filename[i] && filename[i]!='/' && j<8+3; i++, j++)
+			raw[j]=filename[i];
+	}
+}
+
+#if FS32_NAME_INDEX_SUPPORT || OPEN_FILES_HASHED
+static uint32_t raw_name_hash(char const * const raw_name)
+{
+	uint32_t Hash=2166136261UL; //FNV-1a
+	uint8_t i;
+	for(i=0; i<8+3; i++)
 	{
-		for(i++, j=0; OpenFiles[FILENR_ARR_INDEX].Name[i]; i++, j++)
-			entry->DIR_Ext[j]=OpenFiles[FILENR_ARR_INDEX].Name[i];
+		Hash^=(uint8_t)raw_name[i];
+		Hash*=16777619UL;
 	}
+	
+	return Hash;
+}
+#endif
+
+#if FS32_NAME_INDEX_SUPPORT
+static uint32_t name_index_hash(char const * const raw_name)
+{
+	return raw_name_hash(raw_name)%(FS32_NAME_INDEX_SECTORS*NAME_INDEX_SLOTS_PER_SECTOR);
 }
 
-static void fat32_search_for_file(FIRST_ARG_FILENR char const * const filename)
+//Looks for raw_name by linear probing. Returns true and the slot and its content if found, otherwise false and the first slot usable for inserting raw_name (NAME_INDEX_NO_SLOT if the table is full).
+static bool name_index_find(char const * const raw_name, uint32_t * const slot, uint32_t * const sector_dir_entry, uint8_t * const index_dir_entry)
 {
-	OpenFiles[FILENR_ARR_INDEX].FileFound=false;
+	uint32_t Slot=name_index_hash(raw_name);
+	uint32_t CurrentSector=0;
+	uint32_t n;
 	
-	uint32_t cl=RootSector;
+	(*slot)=NAME_INDEX_NO_SLOT;
 	
-	while(!IS_EOC_MARKER(cl))
+	for(n=0; n<FS32_NAME_INDEX_SECTORS*NAME_INDEX_SLOTS_PER_SECTOR; n++)
 	{
-		fat32_directory_entry_t DirEntry;
-		uint8_t NbEntry=0;
-		
-		bool NoMoreEntries=false;
+		uint32_t Sector=NameIndexFirstCluster+1+Slot/NAME_INDEX_SLOTS_PER_SECTOR;
+		if(Sector!=CurrentSector)
+		{
+			read_logical_sector(Sector, Buffer);
+			CurrentSector=Sector;
+		}
 		
-		read_logical_sector(cl, Buffer);
+		fs32_name_index_slot_t * Entry=&((fs32_name_index_slot_t*)Buffer)[Slot%NAME_INDEX_SLOTS_PER_SECTOR];
 		
-		for(NbEntry=0; NbEntry<512/sizeof(fat32_directory_entry_t); NbEntry++)
+		if((uint8_t)Entry->Name[0]==NAME_INDEX_SLOT_EMPTY)
 		{
-			memcpy(&DirEntry, &(((fat32_directory_entry_t*)Buffer)[NbEntry]), sizeof(fat32_directory_entry_t));
-			
-			if((uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE)
-				continue;
-			
-			if((uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE_NO_MORE_DIR)
-			{
-				NoMoreEntries=true;
-				break;
-			}
-			
-			if(DirEntry.DIR_Attr&ATTR_LONG_NAME)
-			{
-				//LONG NAMES ARE UNSUPPORTED!
-				break;
-			}
-			
-			char Name[8+1+3+1];
-			fat32_filename_to_string(&DirEntry, Name);
-			
-			if(!strcmp(Name, filename))
-			{
-				OpenFiles[FILENR_ARR_INDEX].FileFound=true;
-				OpenFiles[FILENR_ARR_INDEX].LogicalSector=((uint32_t)DirEntry.DIR_FstClusHI<<16)|DirEntry.DIR_FstClusLO;
-				OpenFiles[FILENR_ARR_INDEX].FirstLogicalSector=OpenFiles[FILENR_ARR_INDEX].LogicalSector; //needed for f_seek for file in modify-mode
-				OpenFiles[FILENR_ARR_INDEX].FileSize=DirEntry.DIR_FileSize;
-				OpenFiles[FILENR_ARR_INDEX].SectorDirEntry=cl;
-				OpenFiles[FILENR_ARR_INDEX].IndexDirEntry=NbEntry;
-				break;
-			}
+			if((*slot)==NAME_INDEX_NO_SLOT)
+				(*slot)=Slot;
+			break;
 		}
 		
-		if(NoMoreEntries || OpenFiles[FILENR_ARR_INDEX].FileFound)
-			break;
+		if((uint8_t)Entry->Name[0]==NAME_INDEX_SLOT_DELETED)
+		{
+			if((*slot)==NAME_INDEX_NO_SLOT)
+				(*slot)=Slot;
+		}
+		else if(!memcmp(Entry->Name, raw_name, 8+3))
+		{
+			(*slot)=Slot;
+			(*sector_dir_entry)=Entry->SectorDirEntry;
+			(*index_dir_entry)=Entry->IndexDirEntry;
+			return true;
+		}
 		
-		cl=fat32_get_next_sector(cl);
+		Slot=(Slot+1)%(FS32_NAME_INDEX_SECTORS*NAME_INDEX_SLOTS_PER_SECTOR);
 	}
+	
+	return false;
 }
 
-#if !FS32_NO_APPEND || !FS32_NO_WRITE
-static pos_fat32_entry_t fat32_get_next_free_entry(void)
+//raw_name==NULL marks the slot as deleted
+static void name_index_write_slot(const uint32_t slot, char const * const raw_name, const uint32_t sector_dir_entry, const uint8_t index_dir_entry)
 {
-	pos_fat32_entry_t p;
-
-	if(NbFreeSectors==0)
+	uint32_t Sector=NameIndexFirstCluster+1+slot/NAME_INDEX_SLOTS_PER_SECTOR;
+	
+	read_logical_sector(Sector, Buffer);
+	
+	fs32_name_index_slot_t * Entry=&((fs32_name_index_slot_t*)Buffer)[slot%NAME_INDEX_SLOTS_PER_SECTOR];
+	
+	if(raw_name)
 	{
-		p.noFreeSpace=true;
-		return p;
+		memcpy(Entry->Name, raw_name, 8+3);
+		Entry->SectorDirEntry=sector_dir_entry;
+		Entry->IndexDirEntry=index_dir_entry;
 	}
+	else
+		Entry->Name[0]=NAME_INDEX_SLOT_DELETED;
 	
-	NbFreeSectors--;
+	write_logical_sector(Sector, Buffer);
+}
+
+static void name_index_insert(char const * const raw_name, const uint32_t sector_dir_entry, const uint8_t index_dir_entry)
+{
+	uint32_t Slot, Sector;
+	uint8_t Index;
 	
-	p=get_pos_fat_entry(LastAllocatedSector+1);
-	p.noFreeSpace=false;
-	p.LogicalSector=LastAllocatedSector+1;
+	name_index_find(raw_name, &Slot, &Sector, &Index);
 	
-	uint32_t Sector=p.FAT_SectorNumber;
-	uint8_t EntryIndex=p.FAT_EntryIndex;
+	if(Slot!=NAME_INDEX_NO_SLOT) //if the table is full the file can still be found by scanning the directory
+		name_index_write_slot(Slot, raw_name, sector_dir_entry, index_dir_entry);
+}
 
-	bool Found=false;
+static void name_index_remove(char const * const raw_name)
+{
+	uint32_t Slot, Sector;
+	uint8_t Index;
 	
-	for(; Sector<RsvdSecCnt+FATSz32; Sector++)
-	{
-		SD_READ_SECTOR(Sector, Buffer);
+	if(name_index_find(raw_name, &Slot, &Sector, &Index))
+		name_index_write_slot(Slot, NULL, 0, 0);
+}
+
+//checks the header and the directory entry of FS32IDX.SYS, 2 sector reads
+static void name_index_validate(const uint32_t cluster)
+{
+	if(cluster<2 || cluster+FS32_NAME_INDEX_SECTORS>TotalNbOfDataSectors+1)
+		return;
+	
+	read_logical_sector(cluster, Buffer);
+	
+	fs32_name_index_header_t * Header=(fs32_name_index_header_t*)Buffer;
+	
+	if(Header->Magic!=NAME_INDEX_MAGIC || Header->VolumeID!=VolumeID || Header->NbTableSectors!=FS32_NAME_INDEX_SECTORS)
+		return;
+	
+	uint32_t SectorDirEntry=Header->SectorDirEntry;
+	uint8_t IndexDirEntry=Header->IndexDirEntry;
+	
+	if(SectorDirEntry<2 || SectorDirEntry>TotalNbOfDataSectors+1 || IndexDirEntry>=DIR_ENTRIES_PER_SECTOR)
+		return;
+	
+	read_logical_sector(SectorDirEntry, Buffer);
+	
+	fat32_directory_entry_t * Entry=&((fat32_directory_entry_t*)Buffer)[IndexDirEntry];
+	
+	//the file could have been deleted on a PC and its clusters reused
+	if(memcmp(Entry->DIR_Name, NAME_INDEX_RAW_NAME, 8+3) || (((uint32_t)Entry->DIR_FstClusHI<<16)|Entry->DIR_FstClusLO)!=cluster || Entry->DIR_FileSize!=(1+FS32_NAME_INDEX_SECTORS)*(uint32_t)FS32_SECTOR_SIZE)
+		return;
+	
+	NameIndexFirstCluster=cluster;
+}
+#endif
+
+//fills the position of the directory entry, the first cluster and the size of file if found
+static search_result_t fat32_search_in_dir(const uint32_t dir_cluster, char const * const raw_name, file_t * const file)
+{
+	search_result_t Result=SEARCH_NOT_FOUND;
+	
+#if FS32_NAME_INDEX_SUPPORT
+	uint32_t Slot=NAME_INDEX_NO_SLOT;
+	bool InIndex=false;
+	bool UseIndex=(NameIndexFirstCluster && dir_cluster==RootSector); //root directory only
+	
+	if(UseIndex)
+	{
+		uint32_t SectorDirEntry;
+		uint8_t IndexDirEntry;
+		InIndex=name_index_find(raw_name, &Slot, &SectorDirEntry, &IndexDirEntry);
+		
+		//the index is only a hint, the directory entry must still be there (the card could have been used on a PC)
+		if(InIndex && SectorDirEntry>=2 && SectorDirEntry<=TotalNbOfDataSectors+1 && IndexDirEntry<DIR_ENTRIES_PER_SECTOR)
+		{
+			read_logical_sector(SectorDirEntry, Buffer);
+			
+			fat32_directory_entry_t * Entry=&((fat32_directory_entry_t*)Buffer)[IndexDirEntry];
+			
+			if(!memcmp(Entry->DIR_Name, raw_name, 8+3) && !(Entry->DIR_Attr&ATTR_VOLUME_ID))
+			{
+				file->LogicalSector=((uint32_t)Entry->DIR_FstClusHI<<16)|Entry->DIR_FstClusLO;
+				file->FirstLogicalSector=file->LogicalSector;
+				file->FileSize=Entry->DIR_FileSize;
+				file->SectorDirEntry=SectorDirEntry;
+				file->IndexDirEntry=IndexDirEntry;
+				return (Entry->DIR_Attr&ATTR_DIRECTORY)?SEARCH_FOUND_DIR:SEARCH_FOUND_FILE;
+			}
+		}
+	}
+#endif
+	
+	uint32_t cl=dir_cluster;
+	
+	while(!IS_EOC_MARKER(cl))
+	{
+		fat32_directory_entry_t DirEntry;
+		uint8_t NbEntry=0;
+		
+		bool NoMoreEntries=false;
+		
+		read_logical_sector(cl, Buffer);
+		
+		for(NbEntry=0; NbEntry<DIR_ENTRIES_PER_SECTOR; NbEntry++)
+		{
+			memcpy(&DirEntry, &(((fat32_directory_entry_t*)Buffer)[NbEntry]), sizeof(fat32_directory_entry_t));
+			
+			if((uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE)
+				continue;
+			
+			if((uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE_NO_MORE_DIR)
+			{
+				NoMoreEntries=true;
+				break;
+			}
+			
+			if((DirEntry.DIR_Attr&ATTR_LONG_NAME_MASK)==ATTR_LONG_NAME || (DirEntry.DIR_Attr&ATTR_VOLUME_ID))
+				continue; //LONG NAMES ARE UNSUPPORTED! The short name follows the long name entries.
+			
+			if(!memcmp(DirEntry.DIR_Name, raw_name, 8+3)) //DIR_Name and DIR_Ext
+			{
+				Result=(DirEntry.DIR_Attr&ATTR_DIRECTORY)?SEARCH_FOUND_DIR:SEARCH_FOUND_FILE;
+				file->LogicalSector=((uint32_t)DirEntry.DIR_FstClusHI<<16)|DirEntry.DIR_FstClusLO;
+				file->FirstLogicalSector=file->LogicalSector; //needed for f_seek for file in modify-mode
+				file->FileSize=DirEntry.DIR_FileSize;
+				file->SectorDirEntry=cl;
+				file->IndexDirEntry=NbEntry;
+				break;
+			}
+		}
+		
+		if(NoMoreEntries || Result!=SEARCH_NOT_FOUND)
+			break;
+		
+		cl=fat32_get_next_sector(cl);
+	}
+	
+#if FS32_NAME_INDEX_SUPPORT
+	//repair the index: file created on a PC or moved, or a stale entry
+	if(UseIndex)
+	{
+		if(Result!=SEARCH_NOT_FOUND && Slot!=NAME_INDEX_NO_SLOT)
+			name_index_write_slot(Slot, raw_name, file->SectorDirEntry, file->IndexDirEntry);
+		else if(Result==SEARCH_NOT_FOUND && InIndex)
+			name_index_write_slot(Slot, NULL, 0, 0);
+	}
+#endif
+	
+	return Result;
+}
+
+#if FS32_SUBDIR_SUPPORT
+static uint32_t dir_cache_lookup(const uint32_t parent, char const * const raw_name)
+{
+	uint8_t i;
+	for(i=0; i<FS32_DIR_CACHE_SIZE; i++)
+	{
+		if(DirCache[i].Cluster && DirCache[i].Parent==parent && !memcmp(DirCache[i].RawName, raw_name, 8+3))
+			return DirCache[i].Cluster;
+	}
+	
+	return 0;
+}
+
+static void dir_cache_insert(const uint32_t parent, char const * const raw_name, const uint32_t cluster)
+{
+	DirCache[DirCacheNext].Parent=parent;
+	memcpy(DirCache[DirCacheNext].RawName, raw_name, 8+3);
+	DirCache[DirCacheNext].Cluster=cluster;
+	DirCacheNext=(DirCacheNext+1)%FS32_DIR_CACHE_SIZE;
+}
+#endif
+
+//Finds the directory of path (sub-directories separated by '/') and converts the last part of path to a raw name. Directories are only searched if not already in the cache. Returns false if a directory on the way does not exist.
+static bool resolve_path(char const * path, uint32_t * const dir_cluster, char * const raw_name)
+{
+	uint32_t Dir=RootSector;
+	
+	if((*path)=='/')
+		path++;
+	
+#if FS32_SUBDIR_SUPPORT
+	char const * Slash;
+	while((Slash=strchr(path, '/'))!=NULL)
+	{
+		filename_to_raw(path, raw_name);
+		
+		uint32_t Cluster=dir_cache_lookup(Dir, raw_name);
+		if(!Cluster)
+		{
+			file_t Entry;
+			if(fat32_search_in_dir(Dir, raw_name, &Entry)!=SEARCH_FOUND_DIR)
+				return false;
+			
+			Cluster=Entry.FirstLogicalSector;
+			if(Cluster<2) //".." of a sub-directory of root
+				Cluster=RootSector;
+			
+			dir_cache_insert(Dir, raw_name, Cluster);
+		}
+		
+		Dir=Cluster;
+		path=Slash+1;
+	}
+#endif
+	
+	filename_to_raw(path, raw_name);
+	(*dir_cluster)=Dir;
+	
+	return true;
+}
+
+#if FS32_NAME_INDEX_SUPPORT || FS32_SUBDIR_SUPPORT
+//also fills DirCluster and RawName of file, even if not found
+static search_result_t fat32_search_for_file(char const * const path, file_t * const file)
+{
+	if(!resolve_path(path, &file->DirCluster, file->RawName))
+		return SEARCH_NO_PATH;
+	
+	return fat32_search_in_dir(file->DirCluster, file->RawName, file);
+}
+#endif
+
+#if FS32_IDLE_STEP_SUPPORT
+static void invalidate_free_cluster_cache(void)
+{
+	FreeClusterCacheCount=0;
+	FreeClusterCacheScanPos=LastAllocatedSector+1;
+	FreeClusterCacheScanIdle=0;
+}
+#endif
+
+#if !FS32_NO_APPEND || !FS32_NO_WRITE
+static pos_fat32_entry_t fat32_get_next_free_entry(void)
+{
+	pos_fat32_entry_t p;
+	p.noFreeSpace=true;
+
+	if(NbFreeSectors==0)
+		return p;
+	
+#if FS32_IDLE_STEP_SUPPORT
+	if(FreeClusterCacheCount)
+	{
+		p=get_pos_fat_entry(FreeClusterCache[FreeClusterCacheHead]);
+		p.noFreeSpace=false;
+		p.LogicalSector=FreeClusterCache[FreeClusterCacheHead];
+		FreeClusterCacheHead=(FreeClusterCacheHead+1)%FS32_FREE_CLUSTER_CACHE_SIZE;
+		FreeClusterCacheCount--;
+	}
+	else
+#endif
+	{
+		uint32_t StartSector=LastAllocatedSector+1;
+		if(StartSector<2 || StartSector>TotalNbOfDataSectors+1) //FSI_Last_Allocated can be unknown (0xFFFFFFFF)
+			StartSector=2;
+		
+		p=get_pos_fat_entry(StartSector);
+		p.noFreeSpace=true;
+		
+		uint32_t Sector=p.FAT_SectorNumber;
+		fat_entry_index_t EntryIndex=p.FAT_EntryIndex;
+		bool WrappedAround=false;
+#if FS32_SNAPSHOT_SUPPORT
+		bool WholeGroup=false; //current group was scanned from its first entry
+		bool Skipped=false;
+#endif
+		
+		while(!WrappedAround || Sector<=p.FAT_SectorNumber)
+		{
+#if FS32_SNAPSHOT_SUPPORT
+			uint16_t * const Count=group_free_of(Sector);
+			if((Sector-RsvdSecCnt)%SnapshotGroupSectors==0)
+				WholeGroup=(EntryIndex==0);
+			
+			if(!(*Count))
+			{
+				//nothing free in this group, continue with the next one
+				Sector+=SnapshotGroupSectors-1-(Sector-RsvdSecCnt)%SnapshotGroupSectors;
+				if(Sector>FATSectorLastEntry)
+					Sector=FATSectorLastEntry;
+				Skipped=true;
+			}
+			else
+#endif
+			{
+				SD_READ_SECTOR(Sector, Buffer);
+				
+				int16_t Index=fat32_find_free_entry_in_sector(Buffer, EntryIndex, fat32_nb_entries_in_sector(Sector));
+				if(Index>=0)
+				{
+					p.noFreeSpace=false;
+					p.LogicalSector=(Sector-RsvdSecCnt)*FAT_ENTRIES_PER_SECTOR+Index;
+					p.FAT_SectorNumber=Sector;
+					p.FAT_EntryIndex=Index;
+					break;
+				}
+			}
+			
+			EntryIndex=0;
+			
+#if FS32_SNAPSHOT_SUPPORT
+			if(WholeGroup && ((Sector-RsvdSecCnt+1)%SnapshotGroupSectors==0 || Sector==FATSectorLastEntry))
+				(*Count)=0; //remember a saturated or wrong count is 0 in fact
+#endif
+			
+			if(Sector==FATSectorLastEntry)
+			{
+				if(WrappedAround) //went all around the FAT (skipping the last group or beginning on the last sector)
+					break;
+				Sector=RsvdSecCnt;
+				WrappedAround=true;
+			}
+			else
+				Sector++;
+		}
+		
+#if FS32_SNAPSHOT_SUPPORT
+		if(p.noFreeSpace && Skipped)
+		{
+			//the counts of the groups were wrong, search again without them
+			memset(GroupFree, 0xFF, sizeof(GroupFree)); //SNAPSHOT_GROUP_MANY
+			return fat32_get_next_free_entry();
+		}
+#endif
+	}
+	
+	if(p.noFreeSpace)
+		NbFreeSectors=0; //FSINFO was wrong
+	else
+	{
+		NbFreeSectors--;
+		LastAllocatedSector=p.LogicalSector;
+#if FS32_SNAPSHOT_SUPPORT
+		group_free_dec(p.FAT_SectorNumber);
+#endif
+#if FS32_IDLE_STEP_SUPPORT
+		if(RecountSector && p.FAT_SectorNumber<RecountSector)
+			RecountNbFree--;
+		if(!FreeClusterCacheCount)
+			invalidate_free_cluster_cache();
+#endif
+	}
+	
+#if FS32_REALTIME_WRITE
+	FSInfoDirty=true;
+#else
+	update_fsinfo();
+#endif
+
+	return p;
+}
+#endif
+
+#if FS32_ALLOCATION_UNIT_SECTORS
+static bool fat32_clusters_are_free(uint32_t cluster, uint32_t count)
+{
+	while(count)
+	{
+		pos_fat32_entry_t p=get_pos_fat_entry(cluster);
+		fat_entry_index_t NbEntries=FAT_ENTRIES_PER_SECTOR-p.FAT_EntryIndex;
+		if(NbEntries>count)
+			NbEntries=count;
+		
+		SD_READ_SECTOR(p.FAT_SectorNumber, Buffer);
+		
+		if(fat32_count_free_entries_in_sector(Buffer, p.FAT_EntryIndex+NbEntries)-fat32_count_free_entries_in_sector(Buffer, p.FAT_EntryIndex)!=NbEntries)
+			return false;
+		
+		cluster+=NbEntries;
+		count-=NbEntries;
+	}
+	
+	return true;
+}
+
+//first cluster that is on an AU boundary of the card
+static uint32_t fat32_first_aligned_cluster(void)
+{
+	uint32_t FirstDataSectorOfCard=FirstDataSector;
+#if FS32_PARTITION_SUPPORT
+	FirstDataSectorOfCard+=StartOfPartition;
+#endif
+	return 2+(FS32_ALLOCATION_UNIT_SECTORS-FirstDataSectorOfCard%FS32_ALLOCATION_UNIT_SECTORS)%FS32_ALLOCATION_UNIT_SECTORS;
+}
+
+#if !FS32_REALTIME_WRITE
+//true if at least one of count clusters beginning at cluster is free
+static bool fat32_some_cluster_is_free(uint32_t cluster, uint32_t count)
+{
+	while(count)
+	{
+		pos_fat32_entry_t p=get_pos_fat_entry(cluster);
+		fat_entry_index_t NbEntries=FAT_ENTRIES_PER_SECTOR-p.FAT_EntryIndex;
+		if(NbEntries>count)
+			NbEntries=count;
+		
+		SD_READ_SECTOR(p.FAT_SectorNumber, Buffer);
+		
+		if(fat32_find_free_entry_in_sector(Buffer, p.FAT_EntryIndex, p.FAT_EntryIndex+NbEntries)>=0)
+			return true;
+		
+		cluster+=NbEntries;
+		count-=NbEntries;
+	}
+	
+	return false;
+}
+
+static uint32_t fat32_last_cluster_of_allocation_unit(const uint32_t cluster)
+{
+	uint32_t FirstAlignedCluster=fat32_first_aligned_cluster();
+	
+	if(cluster<FirstAlignedCluster)
+		return FirstAlignedCluster-1;
+	
+	return cluster+(FS32_ALLOCATION_UNIT_SECTORS-1)-(cluster-FirstAlignedCluster)%FS32_ALLOCATION_UNIT_SECTORS;
+}
+#endif
+
+//first AU beginning after LastAllocatedSector, where the search for a free AU starts after f_init()
+static void fat32_init_free_allocation_unit_search(void)
+{
+	uint32_t FirstAlignedCluster=fat32_first_aligned_cluster();
+	
+	FreeAUSearchPos=0;
+	NoFreeAU=false;
+	
+	if(LastAllocatedSector>=FirstAlignedCluster && LastAllocatedSector<=TotalNbOfDataSectors+1)
+		FreeAUSearchPos=(LastAllocatedSector+1-FirstAlignedCluster+FS32_ALLOCATION_UNIT_SECTORS-1)/FS32_ALLOCATION_UNIT_SECTORS;
+}
+
+//move LastAllocatedSector just before the next entirely free allocation unit of the card so a new file (or a file whose AU is full) continues on an AU boundary
+//The search continues where the previous one stopped, going around the end of the card, so every AU is checked (one FAT sector read if it is not free) at most once until all have been checked. A full card is not searched again until clusters are freed.
+static void fat32_goto_free_allocation_unit(void)
+{
+	if(NoFreeAU || NbFreeSectors<FS32_ALLOCATION_UNIT_SECTORS)
+		return;
+	
+	uint32_t FirstAlignedCluster=fat32_first_aligned_cluster();
+	
+	if(FirstAlignedCluster+FS32_ALLOCATION_UNIT_SECTORS>TotalNbOfDataSectors+2)
+		return;
+	
+	uint32_t NbAllocationUnits=(TotalNbOfDataSectors+2-FirstAlignedCluster)/FS32_ALLOCATION_UNIT_SECTORS;
+	
+	uint32_t i;
+	for(i=0; i<NbAllocationUnits; i++)
+	{
+		if(FreeAUSearchPos>=NbAllocationUnits)
+			FreeAUSearchPos=0;
+		
+		uint32_t FirstCluster=FirstAlignedCluster+FreeAUSearchPos*FS32_ALLOCATION_UNIT_SECTORS;
+		
+		FreeAUSearchPos++; //this AU is either not free or is being handed out now
+		
+		if(fat32_clusters_are_free(FirstCluster, FS32_ALLOCATION_UNIT_SECTORS))
+		{
+			LastAllocatedSector=FirstCluster-1;
+#if FS32_IDLE_STEP_SUPPORT
+			invalidate_free_cluster_cache();
+#endif
+			return;
+		}
+	}
+	
+	//no free AU, just continue after the last allocated cluster
+	NoFreeAU=true;
+}
+#endif
+
+#if !FS32_NO_UNLINK || !FS32_NO_TRUNCATE || FS32_DEFRAG_SUPPORT || FS32_CONCAT_SUPPORT || FS32_COMPACT_ROOT_SUPPORT || FS32_NAME_INDEX_SUPPORT || FS32_SUBDIR_SUPPORT
+//free the cluster chain beginning at cluster (or mark cluster as end of chain and free the rest if KeepFirst), reading and writing every FAT sector only once while the chain stays inside it
+//NOT done: one read and one write per touched FAT sector for any chain. The next link is only known after reading the sector it is in and there is only one sector buffer, so a chain going back and forth between FAT sectors costs a read and a write each time it changes sector (with FS32_WRITEBACK_SECTORS these are served from the queue)
+static void fat32_free_chain(uint32_t cluster, const bool KeepFirst)
+{
+	uint32_t NbFreed=0;
+	uint32_t LowestFreed=0xFFFFFFFF;
+	
+	pos_fat32_entry_t p=get_pos_fat_entry(cluster);
+	uint32_t CurrentSector=p.FAT_SectorNumber;
+	
+	SD_READ_SECTOR(CurrentSector, Buffer);
+	
+	bool First=true;
+#if FS32_WRITEBACK_SECTORS
+	bool CutPending=KeepFirst; //the new end of the chain must reach the card before the rest is freed, the queue writes FAT sectors from the end
+#endif
+	
+#if FS32_DISCARD_SUPPORT
+	uint32_t DiscardStart=0;
+	uint32_t DiscardCount=0;
+#endif
+	
+	while(1)
+	{
+		fat32_entry_t * Entry=&((fat32_entry_t*)Buffer)[p.FAT_EntryIndex];
+		uint32_t next=(*Entry)&0x0FFFFFFF;
+		
+		if(First && KeepFirst)
+			(*Entry)=EndOfClusterChainMarker;
+		else
+		{
+			(*Entry)&=0xF0000000; //upper 4 bits are reserved and must be preserved
+			NbFreed++;
+			if(cluster<LowestFreed)
+				LowestFreed=cluster;
+#if FS32_SNAPSHOT_SUPPORT
+			group_free_inc(p.FAT_SectorNumber);
+#endif
+#if FS32_DISCARD_SUPPORT
+			if(DiscardCount && cluster==DiscardStart+DiscardCount)
+				DiscardCount++;
+			else
+			{
+				if(DiscardCount)
+					SD_DISCARD_SECTORS(LOGICAL_SECTOR_TO_PHYSICAL(DiscardStart), DiscardCount);
+				DiscardStart=cluster;
+				DiscardCount=1;
+			}
+#endif
+#if FS32_IDLE_STEP_SUPPORT
+			if(RecountSector && p.FAT_SectorNumber<RecountSector)
+				RecountNbFree++;
+#endif
+		}
+		First=false;
+		
+		if(next<2 || next>TotalNbOfDataSectors+1) //end of chain (or broken chain)
+			break;
+		
+		cluster=next;
+		p=get_pos_fat_entry(cluster);
+		
+		if(p.FAT_SectorNumber!=CurrentSector)
+		{
+			fat32_write_fat_sector(CurrentSector, Buffer);
+#if FS32_WRITEBACK_SECTORS
+			if(CutPending)
+				writeback_flush();
+			CutPending=false;
+#endif
+			CurrentSector=p.FAT_SectorNumber;
+			SD_READ_SECTOR(CurrentSector, Buffer);
+		}
+	}
+	
+	fat32_write_fat_sector(CurrentSector, Buffer);
+	
+#if FS32_DISCARD_SUPPORT
+	if(DiscardCount)
+		SD_DISCARD_SECTORS(LOGICAL_SECTOR_TO_PHYSICAL(DiscardStart), DiscardCount);
+#endif
+	
+	if(!NbFreed)
+		return;
+	
+	NbFreeSectors+=NbFreed;
+	
+	if(LowestFreed-1<LastAllocatedSector) //reuse freed space as soon as possible
+		LastAllocatedSector=LowestFreed-1;
+	
+#if FS32_ALLOCATION_UNIT_SECTORS
+	NoFreeAU=false; //an AU may be entirely free now
+#endif
+	
+#if FS32_IDLE_STEP_SUPPORT
+	invalidate_free_cluster_cache();
+#endif
+	
+	update_fsinfo();
+}
+#endif
+
+#if FS32_DEFRAG_SUPPORT || FS32_NAME_INDEX_SUPPORT
+//number of clusters of a chain and number of fragments (runs of contiguous clusters)
+static void fat32_get_chain_layout(uint32_t cluster, uint32_t * const NbClusters, uint32_t * const NbFragments)
+{
+	uint32_t CurrentSector=0;
+	
+	(*NbClusters)=0;
+	(*NbFragments)=1;
+	
+	while(1)
+	{
+		(*NbClusters)++;
+		
+		pos_fat32_entry_t p=get_pos_fat_entry(cluster);
+		if(p.FAT_SectorNumber!=CurrentSector)
+		{
+			CurrentSector=p.FAT_SectorNumber;
+			SD_READ_SECTOR(CurrentSector, Buffer);
+		}
+		
+		uint32_t next=((fat32_entry_t*)Buffer)[p.FAT_EntryIndex]&0x0FFFFFFF;
+		if(next<2 || next>TotalNbOfDataSectors+1)
+			break;
+		
+		if(next!=cluster+1)
+			(*NbFragments)++;
+		
+		cluster=next;
+	}
+}
+
+//returns the first cluster of count contiguous free clusters or 0
+static uint32_t fat32_find_free_run(const uint32_t count)
+{
+	uint32_t RunStart=0;
+	uint32_t RunLength=0;
+	uint32_t Sector;
+	
+	for(Sector=RsvdSecCnt; Sector<=FATSectorLastEntry; Sector++)
+	{
+		SD_READ_SECTOR(Sector, Buffer);
+		
+		fat_entry_index_t NbEntries=fat32_nb_entries_in_sector(Sector);
+		fat_entry_index_t NbFree=fat32_count_free_entries_in_sector(Buffer, NbEntries);
+		
+		if(NbFree==0)
+		{
+			RunLength=0;
+			continue;
+		}
+		
+		if(NbFree==NbEntries && RunLength+NbEntries<count)
+		{
+			if(!RunLength)
+				RunStart=(Sector-RsvdSecCnt)*FAT_ENTRIES_PER_SECTOR;
+			RunLength+=NbEntries;
+			continue;
+		}
+		
+		fat_entry_index_t Index;
+		for(Index=0; Index<NbEntries; Index++)
+		{
+			if(((fat32_entry_t*)Buffer)[Index]&0x0FFFFFFF)
+				RunLength=0;
+			else
+			{
+				if(!RunLength)
+					RunStart=(Sector-RsvdSecCnt)*FAT_ENTRIES_PER_SECTOR+Index;
+				if(++RunLength==count)
+					return RunStart;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+//write a chain of count contiguous free clusters and take them from the free count (FSINFO is not updated), every FAT sector is read and written once
+static void fat32_write_contiguous_chain(uint32_t cluster, uint32_t count)
+{
+	NbFreeSectors-=count;
+	
+	while(count)
+	{
+		pos_fat32_entry_t p=get_pos_fat_entry(cluster);
+		
+		SD_READ_SECTOR(p.FAT_SectorNumber, Buffer);
+		
+		do
+		{
+			count--;
+			((fat32_entry_t*)Buffer)[p.FAT_EntryIndex]=count?(cluster+1):EndOfClusterChainMarker;
+#if FS32_IDLE_STEP_SUPPORT
+			if(RecountSector && p.FAT_SectorNumber<RecountSector)
+				RecountNbFree--;
+#endif
+#if FS32_SNAPSHOT_SUPPORT
+			group_free_dec(p.FAT_SectorNumber);
+#endif
+			cluster++;
+			p.FAT_EntryIndex++;
+		} while(count && p.FAT_EntryIndex<FAT_ENTRIES_PER_SECTOR);
+		
+		fat32_write_fat_sector(p.FAT_SectorNumber, Buffer);
+	}
+	
+	//the run was not taken by fat32_get_next_free_entry(), forget clusters of it that are in the cache and continue allocating after it
+	LastAllocatedSector=cluster-1;
+#if FS32_IDLE_STEP_SUPPORT
+	invalidate_free_cluster_cache();
+#endif
+}
+#endif
+
+#if FS32_IDLE_STEP_SUPPORT
+static uint16_t refill_free_cluster_cache(uint16_t budget)
+{
+	uint16_t NbSectorsRead=0;
+	
+	while(budget && FreeClusterCacheCount<FS32_FREE_CLUSTER_CACHE_SIZE && FreeClusterCacheCount<NbFreeSectors)
+	{
+		if(FreeClusterCacheScanPos<2 || FreeClusterCacheScanPos>TotalNbOfDataSectors+1)
+			FreeClusterCacheScanPos=2;
+		
+		pos_fat32_entry_t p=get_pos_fat_entry(FreeClusterCacheScanPos);
+		fat_entry_index_t NbEntries=fat32_nb_entries_in_sector(p.FAT_SectorNumber);
+		int16_t Index=p.FAT_EntryIndex;
+		
+		SD_READ_SECTOR(p.FAT_SectorNumber, Buffer);
+		budget--;
+		NbSectorsRead++;
+		
+		while(FreeClusterCacheCount<FS32_FREE_CLUSTER_CACHE_SIZE && (Index=fat32_find_free_entry_in_sector(Buffer, Index, NbEntries))>=0)
+		{
+			uint32_t Cluster=(p.FAT_SectorNumber-RsvdSecCnt)*FAT_ENTRIES_PER_SECTOR+Index;
+			
+			if(FreeClusterCacheCount && Cluster==FreeClusterCache[FreeClusterCacheHead])
+			{
+				//went all around the FAT, every free cluster is in the cache
+				NbFreeSectors=FreeClusterCacheCount;
+				return NbSectorsRead;
+			}
+			
+			FreeClusterCache[(FreeClusterCacheHead+FreeClusterCacheCount)%FS32_FREE_CLUSTER_CACHE_SIZE]=Cluster;
+			FreeClusterCacheCount++;
+			FreeClusterCacheScanIdle=0;
+			FreeClusterCacheScanPos=Cluster+1;
+			
+			if(++Index>=NbEntries)
+				break;
+		}
+		
+		if(FreeClusterCacheCount<FS32_FREE_CLUSTER_CACHE_SIZE)
+		{
+			FreeClusterCacheScanPos=(p.FAT_SectorNumber-RsvdSecCnt+1)*FAT_ENTRIES_PER_SECTOR;
+			
+			if(++FreeClusterCacheScanIdle>FATSectorLastEntry-RsvdSecCnt+1)
+			{
+				//went all around the FAT without finding anything new
+				NbFreeSectors=FreeClusterCacheCount;
+				break;
+			}
+		}
+	}
+	
+	return NbSectorsRead;
+}
+
+static uint16_t recount_free_clusters(uint16_t budget)
+{
+	uint16_t NbSectorsRead=0;
+	
+	while(budget && RecountSector)
+	{
+		SD_READ_SECTOR(RecountSector, Buffer);
+		budget--;
+		NbSectorsRead++;
+		
+		RecountNbFree+=fat32_count_free_entries_in_sector(Buffer, fat32_nb_entries_in_sector(RecountSector));
+		
+		if(RecountSector==FATSectorLastEntry)
+		{
+			RecountSector=0;
+			
+			if(RecountNbFree!=NbFreeSectors)
+			{
+				NbFreeSectors=RecountNbFree;
+				update_fsinfo();
+				NbSectorsRead+=2;
+			}
+		}
+		else
+			RecountSector++;
+	}
+	
+	return NbSectorsRead;
+}
+#endif
+
+#if FS32_RECOUNT_FREE_ON_INIT || FS32_SNAPSHOT_SUPPORT
+static uint32_t fat32_count_free_entries(void)
+{
+	uint32_t NbFree=0;
+	uint32_t Sector;
+	
+#if FS32_SNAPSHOT_SUPPORT
+	memset(GroupFree, 0, sizeof(GroupFree));
+#endif
+	
+#if FS32_MULTI_BLOCK_READ
+	SD_READ_MULTIPLE_SECTORS_START(RsvdSecCnt);
+#endif
+
+	for(Sector=RsvdSecCnt; Sector<=FATSectorLastEntry; Sector++)
+	{
+#if FS32_MULTI_BLOCK_READ
+		sd_read_multiple_sectors_next(Buffer);
+#else
+		SD_READ_SECTOR(Sector, Buffer);
+#endif
+		fat_entry_index_t NbFreeInSector=fat32_count_free_entries_in_sector(Buffer, fat32_nb_entries_in_sector(Sector));
+		NbFree+=NbFreeInSector;
+#if FS32_SNAPSHOT_SUPPORT
+		uint16_t * const Count=group_free_of(Sector);
+		(*Count)=((*Count)>SNAPSHOT_GROUP_MANY-NbFreeInSector)?SNAPSHOT_GROUP_MANY:((*Count)+NbFreeInSector);
+#endif
+	}
+
+#if FS32_MULTI_BLOCK_READ
+	sd_read_multiple_sectors_stop();
+#endif
+	
+	return NbFree;
+}
+#endif
+
+#if !FS32_NO_WRITE
+static bool create_dir_entry(file_t * const file, const uint8_t attr) //in directory file->DirCluster
+{	
+	uint32_t previous_cl=file->DirCluster;
+	uint32_t cl=file->DirCluster;
+	
+	bool FoundFreeEntry=false;
+	
+	fat32_directory_entry_t DirEntry;
+	uint8_t Index=0;
+	
+	while(!IS_EOC_MARKER(cl))
+	{
+		read_logical_sector(cl, Buffer);
+		
+		for(Index=0; Index<DIR_ENTRIES_PER_SECTOR; Index++)
+		{
+			memcpy(&DirEntry, &(((fat32_directory_entry_t*)Buffer)[Index]), sizeof(fat32_directory_entry_t));
+			
+			if((uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE || (uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE_NO_MORE_DIR)
+			{
+				FoundFreeEntry=true;
+				break;
+			}
+		}
+		
+		if(FoundFreeEntry)
+			break;
+		
+		previous_cl=cl;
+		cl=fat32_get_next_sector(cl);
+	}
+	
+	if(!FoundFreeEntry)
+	{
+		pos_fat32_entry_t p_curr=get_pos_fat_entry(previous_cl);
+		pos_fat32_entry_t p_new=fat32_get_next_free_entry();
+		if(p_new.noFreeSpace)
+			return true;
+		fat32_append_cluster(&p_curr, &p_new);
+		cl=p_new.LogicalSector;
+		Index=0;
+		
+		memset(Buffer, DIR_ENTRY_FREE_NO_MORE_DIR, FS32_SECTOR_SIZE);
+	}
+	
+	memset(&DirEntry, 0, sizeof(fat32_directory_entry_t));
+	memcpy(&DirEntry, file->RawName, 8+3); //DIR_Name and DIR_Ext
+	DirEntry.DIR_Attr=attr;
+	DirEntry.DIR_WrtTime=rtc_get_encoded_time();
+	DirEntry.DIR_WrtDate=rtc_get_encoded_date();
+	DirEntry.DIR_FileSize=file->FileSize;
+	DirEntry.DIR_FstClusHI=file->FirstLogicalSector>>16;
+	DirEntry.DIR_FstClusLO=file->FirstLogicalSector&0xFFFF;
+	
+	memcpy(&(((fat32_directory_entry_t*)Buffer)[Index]), &DirEntry, sizeof(fat32_directory_entry_t));
+	
+	write_dir_sector(cl, Buffer);
+	
+	file->SectorDirEntry=cl;
+	file->IndexDirEntry=Index;
+	
+#if FS32_NAME_INDEX_SUPPORT
+	if(NameIndexFirstCluster && file->DirCluster==RootSector)
+		name_index_insert((char*)&DirEntry, cl, Index);
+#endif
+	
+	return false;
+}
+#endif
+
+#if !FS32_NO_APPEND || !FS32_NO_MODIFY
+static void update_dir_entry(ONLY_ARG_FILENR)
+{
+	read_logical_sector(OpenFiles[FILENR_ARR_INDEX].SectorDirEntry, Buffer);
+	
+	fat32_directory_entry_t * Entry=(fat32_directory_entry_t*)Buffer;
+	
+	Entry[OpenFiles[FILENR_ARR_INDEX].IndexDirEntry].DIR_FileSize=OpenFiles[FILENR_ARR_INDEX].FileSize;
+	Entry[OpenFiles[FILENR_ARR_INDEX].IndexDirEntry].DIR_WrtTime=rtc_get_encoded_time();
+	Entry[OpenFiles[FILENR_ARR_INDEX].IndexDirEntry].DIR_WrtDate=rtc_get_encoded_date();
+	
+	write_dir_sector(OpenFiles[FILENR_ARR_INDEX].SectorDirEntry, Buffer);
+}
+#endif
+
+#if !FS32_NO_UNLINK || FS32_CONCAT_SUPPORT || FS32_NAME_INDEX_SUPPORT
+static void delete_dir_entry(file_t const * const file)
+{
+	read_logical_sector(file->SectorDirEntry, Buffer);
+#if FS32_NAME_INDEX_SUPPORT
+	char RawName[8+3];
+	memcpy(RawName, ((fat32_directory_entry_t*)Buffer)[file->IndexDirEntry].DIR_Name, 8+3);
+#endif
+	((fat32_directory_entry_t*)Buffer)[file->IndexDirEntry].DIR_Name[0]=DIR_ENTRY_FREE;
+	write_dir_sector(file->SectorDirEntry, Buffer);
+	
+#if FS32_NAME_INDEX_SUPPORT
+	if(NameIndexFirstCluster && file->DirCluster==RootSector)
+	{
+		if(!memcmp(RawName, NAME_INDEX_RAW_NAME, 8+3)) //its clusters are going to be freed
+			NameIndexFirstCluster=0;
+		else
+			name_index_remove(RawName);
+	}
+#endif
+}
+#endif
+
+#if FS32_CONCAT_SUPPORT || FS32_RECORD_SUPPORT
+static void set_dir_entry_cluster_and_size(file_t const * const file, const uint32_t cluster, const uint32_t size)
+{
+	read_logical_sector(file->SectorDirEntry, Buffer);
+	
+	fat32_directory_entry_t * Entry=&((fat32_directory_entry_t*)Buffer)[file->IndexDirEntry];
+	
+	Entry->DIR_FstClusHI=cluster>>16;
+	Entry->DIR_FstClusLO=cluster&0xFFFF;
+	Entry->DIR_FileSize=size;
+	Entry->DIR_WrtTime=rtc_get_encoded_time();
+	Entry->DIR_WrtDate=rtc_get_encoded_date();
+	
+	write_dir_sector(file->SectorDirEntry, Buffer);
+}
+#endif
+
+#if !FS32_NO_APPEND || !FS32_NO_SEEK_TELL || FS32_RECORD_SUPPORT
+static void set_file_pos(FIRST_ARG_FILENR uint32_t pos)
+{
+	if(pos==FS_SEEK_END)
+		pos=OpenFiles[FILENR_ARR_INDEX].FileSize;
+	
+	OpenFiles[FILENR_ARR_INDEX].PosInFile=pos;
+	OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=pos&SECTOR_MASK;
+	
+	uint32_t NbSectors=pos>>SECTOR_SHIFT;
+	
+	if(NbSectors && pos==OpenFiles[FILENR_ARR_INDEX].FileSize && OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector==0)
+	{
+		//end of file is at the end of the last sector of the chain, stay there, f_write() will append a new sector
+		NbSectors--;
+		OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=FS32_SECTOR_SIZE;
+	}
+	
+	uint32_t sector=OpenFiles[FILENR_ARR_INDEX].FirstLogicalSector;
+	
+	while(NbSectors--)
+		sector=fat32_get_next_sector(sector);
+	
+	OpenFiles[FILENR_ARR_INDEX].LogicalSector=sector;
+}
+#endif
+
+#if OPEN_FILES_HASHED
+static uint8_t open_files_bucket(const uint32_t dir_cluster, char const * const raw_name)
+{
+	return (raw_name_hash(raw_name)^dir_cluster)%FS32_NB_FILES_MAX;
+}
+#endif
+
+#if !SINGLE_FILE_CONFIG
+//the opened slot is always the first one of the free list, the file is added to the hash table
+static void slot_set_open(const uint8_t slot)
+{
+	FreeSlotHead=OpenFiles[slot].Next;
+	
+#if OPEN_FILES_HASHED
+	uint8_t Bucket=open_files_bucket(OpenFiles[slot].DirCluster, OpenFiles[slot].RawName);
+	OpenFiles[slot].Next=OpenFilesHash[Bucket];
+	OpenFilesHash[Bucket]=slot;
+#endif
+}
+
+static void slot_set_closed(const uint8_t slot)
+{
+#if OPEN_FILES_HASHED
+	uint8_t * Link=&OpenFilesHash[open_files_bucket(OpenFiles[slot].DirCluster, OpenFiles[slot].RawName)];
+	while((*Link)!=slot)
+		Link=&OpenFiles[*Link].Next;
+	(*Link)=OpenFiles[slot].Next;
+#endif
+	
+	OpenFiles[slot].Next=FreeSlotHead;
+	FreeSlotHead=slot;
+}
+#endif
+
+//the same name can exist in several directories
+static bool check_if_already_open(const uint32_t dir_cluster, char const * const raw_name)
+{
+#if OPEN_FILES_HASHED
+	uint8_t i=OpenFilesHash[open_files_bucket(dir_cluster, raw_name)];
+	while(i!=FILE_NO_SLOT)
+	{
+		if(OpenFiles[i].DirCluster==dir_cluster && !memcmp(OpenFiles[i].RawName, raw_name, 8+3))
+			return true;
+		i=OpenFiles[i].Next;
+	}
+#else
+	uint8_t i;
+	for(i=0; i<FS32_NB_FILES_MAX; i++)
+	{
+		if(OpenFiles[i].Mode!=FILE_CLOSED && OpenFiles[i].DirCluster==dir_cluster && !memcmp(OpenFiles[i].RawName, raw_name, 8+3))
+			return true;
+	}
+#endif
+	
+	return false;
+}
+
+//public functions
+
+#if FS32_PARTITION_SUPPORT
+FS32_status_t f_set_partition(const uint8_t partition)
+{
+	if(partition>3)
+		return SET_PART_INVALID_NUMBER;
+	
+#if FS32_WRITEBACK_SECTORS
+	writeback_flush(); //still for the old partition
+#endif
+	
+	sd_read_sector(0, Buffer);
+	master_boot_record_t *mbr=(master_boot_record_t*)Buffer;
+	
+	if(mbr->BootSignature!=0xAA55)
+		return SET_PART_INVALID_BOOT_SIG;
+	
+	if(mbr->Partitions[partition].PartitionType!=0x0C)
+		return SET_PART_UNKNOWN_PART_TYPE;
+	
+	if(mbr->Partitions[partition].NumberOfSectors==0)
+		return SET_PART_NO_VALID_PART;
+	
+	StartOfPartition=mbr->Partitions[partition].StartSectorLBA;
+	
+	return STATUS_OK;
+}
+#endif
+
+FS32_status_t f_init(void)
+{
+	uint8_t i;
+	
+#if FS32_WRITEBACK_SECTORS
+	writeback_flush(); //left from before a second f_init()
+#endif
+	
+	for(i=0; i<FS32_NB_FILES_MAX; i++)
+	{
+		OpenFiles[i].Mode=FILE_CLOSED;
+#if FS32_RECORD_SUPPORT
+		RecordMaps[i].RecordSize=0;
+#endif
+#if !SINGLE_FILE_CONFIG
+		OpenFiles[i].Next=(i+1<FS32_NB_FILES_MAX)?(i+1):FILE_NO_SLOT;
+#endif
+#if OPEN_FILES_HASHED
+		OpenFilesHash[i]=FILE_NO_SLOT;
+#endif
+	}
+#if !SINGLE_FILE_CONFIG
+	FreeSlotHead=0;
+#endif
+	
+#if FS32_SUBDIR_SUPPORT
+	for(i=0; i<FS32_DIR_CACHE_SIZE; i++)
+		DirCache[i].Cluster=0;
+	DirCacheNext=0;
+#endif
+	
+	SD_READ_SECTOR(0, Buffer);
+	
+	fat32_header_t *header=(fat32_header_t*)Buffer;
+	
+	if(header->BS_jmpBoot[0]!=0xEB)
+		return INIT_INVALID_JUMP;
+		
+	if(header->BPB_BytsPerSec!=FS32_SECTOR_SIZE)
+		return INIT_INVALID_BYTES_PER_SEC;
+	
+	if(header->BPB_SecPerClus!=1)
+		return INIT_INVALID_SEC_PER_CLUS;
+	
+	if(header->BPB_TotSec16)
+		return INIT_NOT_FAT32;
+	
+	if(header->BPB_FATSz16)
+		return INIT_NOT_FAT32;
+		
+#if FS32_TWO_FAT_SUPPORT
+	if(header->BPB_NumFATs<1 || header->BPB_NumFATs>2)
+		return INIT_MULTIPLE_FAT;
+	
+	//if mirroring is disabled on the volume only the first FAT can be the active one
+	if((header->BPB_ExtFlags&0x80) && (header->BPB_ExtFlags&0x0F))
+		return INIT_MULTIPLE_FAT;
+	
+#if FAT_MIRROR
+	FATMirrorEnabled=(header->BPB_NumFATs==2 && !(header->BPB_ExtFlags&0x80));
+	FATMirrorPending=false;
+	FATMirrorGroupSectors=(header->BPB_FATSz32+8*FS32_FAT_MIRROR_BITMAP_BYTES-1)/(8*FS32_FAT_MIRROR_BITMAP_BYTES);
+	memset(FATMirrorDirty, 0, sizeof(FATMirrorDirty));
+#endif
+#else
+	if(header->BPB_NumFATs!=1)
+		return INIT_MULTIPLE_FAT;
+#endif
+
+	RsvdSecCnt=header->BPB_RsvdSecCnt;
+	RootSector=header->BPB_RootClus;
+#if FS32_NAME_INDEX_SUPPORT || FS32_SNAPSHOT_SUPPORT
+	VolumeID=header->BS_VolID;
+#endif
+	FATSz32=header->BPB_FATSz32;
+	FirstDataSector=header->BPB_RsvdSecCnt+header->BPB_NumFATs*header->BPB_FATSz32;
+	TotalNbOfDataSectors=header->BPB_TotSec32-FirstDataSector;
+	FATSectorLastEntry=RsvdSecCnt+(TotalNbOfDataSectors+1)/FAT_ENTRIES_PER_SECTOR; //clusters are numbered from 2 to TotalNbOfDataSectors+1
+	FATIndexLastEntry=(TotalNbOfDataSectors+1)%FAT_ENTRIES_PER_SECTOR;
+	
+#if FS32_SNAPSHOT_SUPPORT
+	SnapshotSector=header->BPB_BkBootSec+3; //BPB_BkBootSec is 0 if there is no backup of the boot sectors
+	if(SnapshotSector>=RsvdSecCnt)
+		SnapshotSector=0;
+	SnapshotGroupSectors=(FATSectorLastEntry-RsvdSecCnt+FS32_SNAPSHOT_GROUPS)/FS32_SNAPSHOT_GROUPS;
+#endif
+	
+	//FAT EOC-Marker
+	SD_READ_SECTOR(header->BPB_RsvdSecCnt, Buffer);
+	EndOfClusterChainMarker=((fat32_entry_t*)Buffer)[1];
+	
+	//FSINFO
+	SD_READ_SECTOR(1, Buffer);
+	fat32_fsinfo_t *fsinfo=(fat32_fsinfo_t*)Buffer;
+	
+	if(fsinfo->FSI_LeadSig!=FSI_LEADSIG)
+		return INIT_INVALID_FSINFO;
+	
+	NbFreeSectors=fsinfo->FSI_Free_Count;
+	LastAllocatedSector=fsinfo->FSI_Last_Allocated;
+	
+#if FS32_NAME_INDEX_SUPPORT
+	NameIndexFirstCluster=0;
+	uint32_t NameIndexCluster=(fsinfo->FS32_NameIndexSig==NAME_INDEX_FSINFO_SIG)?fsinfo->FS32_NameIndexFirstCluster:0;
+#endif
+	
+#if FS32_RECOUNT_FREE_ON_INIT || FS32_SNAPSHOT_SUPPORT
+#if FS32_SNAPSHOT_SUPPORT
+	bool Recount=!snapshot_load(); //FSINFO can't be trusted after an unclean shutdown
+#if FS32_RECOUNT_FREE_ON_INIT==2
+	Recount=true;
+#endif
+	if(Recount)
+#elif FS32_RECOUNT_FREE_ON_INIT==1
+	if(NbFreeSectors>TotalNbOfDataSectors)
+#endif
+	{
+		NbFreeSectors=fat32_count_free_entries();
+#if !FS32_NO_APPEND || !FS32_NO_WRITE
+		update_fsinfo();
+#endif
+	}
+#endif
+
+#if FS32_ALLOCATION_UNIT_SECTORS
+	fat32_init_free_allocation_unit_search();
+#endif
+
+#if FS32_IDLE_STEP_SUPPORT
+	FreeClusterCacheHead=0;
+	invalidate_free_cluster_cache();
+#if FS32_RECOUNT_FREE_ON_INIT==2
+	RecountSector=0; //already done
+#else
+	RecountSector=RsvdSecCnt;
+	RecountNbFree=0;
+#endif
+#endif
+
+#if FS32_NAME_INDEX_SUPPORT
+	name_index_validate(NameIndexCluster);
+#endif
+	
+	return STATUS_OK;
+}
+
+FS32_status_t f_open(uint8_t * const filenr, char const * const filename, const char mode)
+{
+	uint32_t DirCluster;
+	char RawName[8+3];
+	
+	if(!resolve_path(filename, &DirCluster, RawName))
+		return OPEN_PATH_NOT_FOUND;
+	
+	if(check_if_already_open(DirCluster, RawName))
+		return OPEN_FILE_ALREADY_OPEN;
+	
+#if !SINGLE_FILE_CONFIG	
+	if(FreeSlotHead==FILE_NO_SLOT)
+		return OPEN_NO_FREE_SLOT;
+		
+	(*filenr)=FreeSlotHead; //only taken from the free list if the file is really opened
+#else
+	(void)filenr;
+	if(OpenFiles[FILENR_ARR_INDEX].Mode!=FILE_CLOSED)
+		return OPEN_NO_FREE_SLOT;
+#endif
+
+	OpenFiles[FILENR_PTR_ARR_INDEX].DirCluster=DirCluster;
+	memcpy(OpenFiles[FILENR_PTR_ARR_INDEX].RawName, RawName, 8+3);
+	
+	search_result_t Result=fat32_search_in_dir(DirCluster, RawName, &OpenFiles[FILENR_PTR_ARR_INDEX]);
+	
+	if(Result==SEARCH_FOUND_DIR && mode!='w')
+		return OPEN_IS_DIRECTORY;
+	
+	bool FileFound=(Result!=SEARCH_NOT_FOUND);
+	
+#if !FS32_NO_READ
+	if(mode=='r')
+	{
+		if(!FileFound)
+			return OPEN_FILE_NOT_FOUND;
+		
+		OpenFiles[FILENR_PTR_ARR_INDEX].Mode=FILE_READ;
+		OpenFiles[FILENR_PTR_ARR_INDEX].PosInFile=0;
+		OpenFiles[FILENR_PTR_ARR_INDEX].PosInLogicalSector=0;
+	}
+	else
+#endif
+#if !FS32_NO_WRITE
+	if(mode=='w')
+	{
+		if(FileFound)
+			return OPEN_FILE_ALREADY_EXISTS;
+		else
+		{
+#if FS32_ALLOCATION_UNIT_SECTORS
+			fat32_goto_free_allocation_unit();
+#endif
+			pos_fat32_entry_t FATEntry=fat32_get_next_free_entry();
+			
+			if(FATEntry.noFreeSpace)
+				return OPEN_NO_MORE_SPACE;
+			
+			OpenFiles[FILENR_PTR_ARR_INDEX].Mode=FILE_NEW;
+			OpenFiles[FILENR_PTR_ARR_INDEX].FirstLogicalSector=FATEntry.LogicalSector;
+			OpenFiles[FILENR_PTR_ARR_INDEX].LogicalSector=FATEntry.LogicalSector;
+			OpenFiles[FILENR_PTR_ARR_INDEX].PosInFile=0;
+			OpenFiles[FILENR_PTR_ARR_INDEX].PosInLogicalSector=0;
+			OpenFiles[FILENR_PTR_ARR_INDEX].FileSize=0;
+			
+			fat32_write_entry(&FATEntry, EndOfClusterChainMarker);
+		}
+	} else
+#endif
+#if !FS32_NO_APPEND
+	if(mode=='a')
+	{
+		if(!FileFound)
+			return OPEN_FILE_NOT_FOUND;
+		
+		OpenFiles[FILENR_PTR_ARR_INDEX].Mode=FILE_APPEND;
+		
+		set_file_pos(FILENR_PTR_FUNC_ARG OpenFiles[FILENR_PTR_ARR_INDEX].FileSize);
+	} else
+#endif
+#if !FS32_NO_MODIFY
+	if(mode=='m')
+	{
+		if(!FileFound)
+			return OPEN_FILE_NOT_FOUND;
+		
+		OpenFiles[FILENR_PTR_ARR_INDEX].Mode=FILE_MODIFY;
+		OpenFiles[FILENR_PTR_ARR_INDEX].PosInFile=0;
+		OpenFiles[FILENR_PTR_ARR_INDEX].PosInLogicalSector=0;
+	} else
+#endif
+		return OPEN_INVALID_MODE;
+	
+#if !SINGLE_FILE_CONFIG
+	slot_set_open(*filenr);
+#endif
+	
+	return STATUS_OK;
+}
+
+FS32_status_t f_close(const uint8_t filenr)
+{
+	
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_CLOSED)
+		return STATUS_OK;
+	
+#if !FS32_NO_WRITE || !FS32_NO_APPEND
+	file_mode_t Mode=OpenFiles[FILENR_ARR_INDEX].Mode;
+#endif
+	OpenFiles[FILENR_ARR_INDEX].Mode=FILE_CLOSED;
+#if !SINGLE_FILE_CONFIG
+	slot_set_closed(filenr);
+#endif
+#if FS32_RECORD_SUPPORT
+	RecordMaps[FILENR_ARR_INDEX].RecordSize=0;
+#endif
+	
+#if !FS32_NO_WRITE	
+	if(Mode==FILE_NEW)
+	{
+		if(create_dir_entry(&OpenFiles[FILENR_ARR_INDEX], 0))
+			return CLOSE_CREATE_DIR_ENTRY_FAILED;
+	}
+#endif
+
+#if !FS32_NO_APPEND || !FS32_NO_MODIFY
+	if(Mode==FILE_APPEND || Mode==FILE_MODIFY)
+	{
+		update_dir_entry(FILENR_ONLY_FUNC_ARG);
+	}
+#endif
+
+#if FS32_REALTIME_WRITE
+	if(FSInfoDirty)
+		update_fsinfo();
+#endif
+
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF);
+#endif
+
+#if FS32_WRITEBACK_SECTORS
+	writeback_flush();
+#endif
+	
+	return STATUS_OK;
+}
+
+#if !FS32_NO_READ
+FS32_status_t f_read(const uint8_t filenr, void * ptr, const uint16_t size, const uint16_t n)
+{
+	
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	uint32_t NbBytesToRead=(uint32_t)size*n;
+	
+	while(NbBytesToRead && OpenFiles[FILENR_ARR_INDEX].PosInFile<OpenFiles[FILENR_ARR_INDEX].FileSize)
+	{
+		uint32_t NbToCopy=NbBytesToRead;
+		if(NbToCopy>(uint32_t)(FS32_SECTOR_SIZE-OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector))
+			NbToCopy=(uint32_t)(FS32_SECTOR_SIZE-OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector);
+		if(NbToCopy>(OpenFiles[FILENR_ARR_INDEX].FileSize-OpenFiles[FILENR_ARR_INDEX].PosInFile))
+			NbToCopy=OpenFiles[FILENR_ARR_INDEX].FileSize-OpenFiles[FILENR_ARR_INDEX].PosInFile;
+
+		read_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
+		
+		memcpy(ptr, Buffer+OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector, NbToCopy);
+		
+		ptr+=NbToCopy;
+		NbBytesToRead-=NbToCopy;
+		OpenFiles[FILENR_ARR_INDEX].PosInFile+=NbToCopy;
+		OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector+=NbToCopy;
+		if(OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector>=FS32_SECTOR_SIZE)
+		{
+			OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector-=FS32_SECTOR_SIZE;
+			OpenFiles[FILENR_ARR_INDEX].LogicalSector=fat32_get_next_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector);
+			if(OpenFiles[FILENR_ARR_INDEX].LogicalSector==EndOfClusterChainMarker)
+				break;
+		}
+	}
+	
+	if(NbBytesToRead)
+		return READ_FAILED;
+	else
+		return STATUS_OK;
+}
+#endif
+
+#if !FS32_NO_APPEND || !FS32_NO_WRITE || !FS32_NO_MODIFY
+//the current sector is full and more data follows: go to the next sector of the chain or append a new cluster to the file
+static FS32_status_t goto_next_sector(ONLY_ARG_FILENR)
+{
+	bool NeedMoreSpace=false;
+	
+#if !FS32_NO_MODIFY			
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_MODIFY)
+	{
+		uint32_t nextSector=fat32_get_next_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector);
+		if(IS_EOC_MARKER(nextSector))
+			NeedMoreSpace=true;
+		else
+		{
+			OpenFiles[FILENR_ARR_INDEX].LogicalSector=nextSector;
+			OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=0;
+		}
+	}
+#endif
+	
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_APPEND || OpenFiles[FILENR_ARR_INDEX].Mode==FILE_NEW || NeedMoreSpace)
+	{
+#if FS32_REALTIME_WRITE
+		if(!FreeClusterCacheCount && NbFreeSectors)
+			return WRITE_RT_NO_CACHED_CLUSTER; //searching the FAT here would break the guaranteed maximum number of IO
+#endif
+#if FS32_ALLOCATION_UNIT_SECTORS && !FS32_REALTIME_WRITE
+		uint32_t LastOfAU=fat32_last_cluster_of_allocation_unit(OpenFiles[FILENR_ARR_INDEX].LogicalSector);
+		bool AUFull=(OpenFiles[FILENR_ARR_INDEX].LogicalSector>=LastOfAU);
+		
+		if(LastAllocatedSector!=OpenFiles[FILENR_ARR_INDEX].LogicalSector)
+		{
+			//another file was extended in between, continue filling the AU of this file
+			LastAllocatedSector=OpenFiles[FILENR_ARR_INDEX].LogicalSector;
+#if FS32_IDLE_STEP_SUPPORT
+			invalidate_free_cluster_cache();
+#endif
+			if(!AUFull)
+				AUFull=!fat32_some_cluster_is_free(LastAllocatedSector+1, LastOfAU-LastAllocatedSector);
+		}
+		
+		if(AUFull)
+			fat32_goto_free_allocation_unit(); //not into the AU another file may be filling after this one
+#endif
+		pos_fat32_entry_t p_curr=get_pos_fat_entry(OpenFiles[FILENR_ARR_INDEX].LogicalSector);
+		pos_fat32_entry_t p_new=fat32_get_next_free_entry();
+		if(p_new.noFreeSpace)
+			return WRITE_NO_MORE_SPACE;
+		fat32_append_cluster(&p_curr, &p_new);
+		OpenFiles[FILENR_ARR_INDEX].LogicalSector=p_new.LogicalSector;
+		OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=0;
+	}
+	
+	return STATUS_OK;
+}
+
+FS32_status_t f_write(const uint8_t filenr, void const * ptr, const uint16_t size, const uint16_t n)
+{
+	
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_CLOSED)
+		return WRITE_NO_OPEN_FILE;
+	
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_READ)
+		return WRITE_FILE_READ_ONLY;
+	
+	uint32_t NbBytesToWrite=(uint32_t)size*n;
+	
+	
+	while(NbBytesToWrite)
+	{
+		uint16_t NbBytesToCopy=FS32_SECTOR_SIZE-OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector;
+		
+		bool IncreasingSize=false;
+		
+		if(OpenFiles[FILENR_ARR_INDEX].PosInFile+NbBytesToWrite>OpenFiles[FILENR_ARR_INDEX].FileSize)
+			IncreasingSize=true;
+		
+		if(NbBytesToCopy>NbBytesToWrite)
+			NbBytesToCopy=NbBytesToWrite;
+		
+		if(NbBytesToCopy) //avoid reading a sector just to write it again without change
+		{
+			if(OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector!=0 || OpenFiles[FILENR_ARR_INDEX].Mode==FILE_MODIFY)
+				read_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
+			
+			memcpy(Buffer+OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector, ptr, NbBytesToCopy);
+			
+			write_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
+
+			NbBytesToWrite-=NbBytesToCopy;
+			ptr+=NbBytesToCopy;
+			
+			if(IncreasingSize)
+				OpenFiles[FILENR_ARR_INDEX].FileSize=OpenFiles[FILENR_ARR_INDEX].PosInFile+NbBytesToCopy;
+
+			OpenFiles[FILENR_ARR_INDEX].PosInFile+=NbBytesToCopy;
+			OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector+=NbBytesToCopy;
+		}
+		
+		if(NbBytesToWrite)
+		{
+			FS32_status_t Status=goto_next_sector(FILENR_ONLY_FUNC_ARG);
+			if(Status!=STATUS_OK)
+				return Status;
+		}
+	}
+	
+	return STATUS_OK;
+}
+#endif
+
+#if FS32_PRINTF_SUPPORT
+//the current sector of the file is kept in Buffer while formatting, it is only written when it is full and at the end of f_printf()
+static FS32_status_t printf_putc(FIRST_ARG_FILENR const char c, bool * const dirty)
+{
+	if(OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector>=FS32_SECTOR_SIZE)
+	{
+		if(*dirty)
+			write_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
+		*dirty=false;
+		
+		FS32_status_t Status=goto_next_sector(FILENR_ONLY_FUNC_ARG);
+		if(Status!=STATUS_OK)
+			return Status;
+		
+		if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_MODIFY && OpenFiles[FILENR_ARR_INDEX].PosInFile<OpenFiles[FILENR_ARR_INDEX].FileSize)
+			read_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
+	}
+	
+	Buffer[OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector++]=c;
+	*dirty=true;
+	
+	OpenFiles[FILENR_ARR_INDEX].PosInFile++;
+	if(OpenFiles[FILENR_ARR_INDEX].PosInFile>OpenFiles[FILENR_ARR_INDEX].FileSize)
+		OpenFiles[FILENR_ARR_INDEX].FileSize=OpenFiles[FILENR_ARR_INDEX].PosInFile;
+	
+	return STATUS_OK;
+}
+
+FS32_status_t f_printf(const uint8_t filenr, char const * format, ...)
+{
+	
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_CLOSED)
+		return WRITE_NO_OPEN_FILE;
+	
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_READ)
+		return WRITE_FILE_READ_ONLY;
+	
+	//like f_write() a new sector at the end of the file is not read
+	if(OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector<FS32_SECTOR_SIZE && (OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector!=0 || OpenFiles[FILENR_ARR_INDEX].Mode==FILE_MODIFY))
+		read_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
+	
+	FS32_status_t Status=STATUS_OK;
+	bool Dirty=false;
+	va_list args;
+	va_start(args, format);
+	
+	while(*format && Status==STATUS_OK)
+	{
+		if(*format!='%')
+		{
+			Status=printf_putc(FILENR_FIRST_FUNC_ARG *format++, &Dirty);
+			continue;
+		}
+		
+		char const * const Start=format++;
+		bool LeftAlign=false;
+		char Pad=' ';
+		uint8_t Width=0;
+		uint8_t Decimals=0;
+		bool Long=false;
+		
+		for(;; format++)
+		{
+			if(*format=='-')
+				LeftAlign=true;
+			else if(*format=='0')
+				Pad='0';
+			else
+				break;
+		}
+		while(*format>='0' && *format<='9')
+			Width=Width*10+(*format++-'0');
+		if(*format=='.')
+		{
+			format++;
+			while(*format>='0' && *format<='9')
+				Decimals=Decimals*10+(*format++-'0');
+		}
+		if(*format=='l')
+		{
+			Long=true;
+			format++;
+		}
+		
+		char Digits[PRINTF_MAX_DIGITS]; //in reverse order
+		char const * Text=Digits;
+		uint16_t Length=0;
+		bool Number=false;
+		bool Negative=false;
+		
+		switch(*format)
+		{
+			case 'c':
+				Digits[0]=(char)va_arg(args, int);
+				Length=1;
+				break;
+			
+			case 's':
+				Text=va_arg(args, char const *);
+				Length=strlen(Text);
+				break;
+			
+			case '%':
+				Digits[0]='%';
+				Length=1;
+				break;
+			
+			case 'd':
+			case 'u':
+			case 'x':
+			{
+				Number=true;
+				unsigned long Value;
+				if(*format=='d')
+				{
+					long v=Long?va_arg(args, long):va_arg(args, int);
+					Negative=(v<0);
+					Value=Negative?-(unsigned long)v:(unsigned long)v;
+				}
+				else
+					Value=Long?va_arg(args, unsigned long):va_arg(args, unsigned int);
+				
+				const uint8_t Base=(*format=='x')?16:10;
+				if(Base==16 || Decimals>PRINTF_MAX_DIGITS-2)
+					Decimals=0;
+				
+				do
+				{
+					if(Decimals && Length==Decimals)
+						Digits[Length++]='.'; //fixed point: the value is in units of 10^-Decimals
+					uint8_t Digit=Value%Base;
+					Digits[Length++]=(Digit<10)?('0'+Digit):('a'-10+Digit);
+					Value/=Base;
+				} while(Value || (Decimals && Length<=Decimals+1));
+				break;
+			}
+			
+			default: //unknown conversion, written as it is
+				format=Start;
+				Status=printf_putc(FILENR_FIRST_FUNC_ARG *format++, &Dirty);
+				continue;
+		}
+		format++;
+		
+		uint16_t NbPad=(Width>Length+Negative)?(Width-Length-Negative):0;
+		if(LeftAlign || !Number)
+			Pad=' ';
+		
+		if(!LeftAlign && Pad==' ')
+		{
+			for(; NbPad && Status==STATUS_OK; NbPad--)
+				Status=printf_putc(FILENR_FIRST_FUNC_ARG ' ', &Dirty);
+		}
+		
+		if(Negative && Status==STATUS_OK)
+			Status=printf_putc(FILENR_FIRST_FUNC_ARG '-', &Dirty);
+		
+		if(!LeftAlign) //zeros go between the sign and the digits
+		{
+			for(; NbPad && Status==STATUS_OK; NbPad--)
+				Status=printf_putc(FILENR_FIRST_FUNC_ARG '0', &Dirty);
+		}
+		
+		uint16_t i;
+		for(i=0; i<Length && Status==STATUS_OK; i++)
+			Status=printf_putc(FILENR_FIRST_FUNC_ARG Number?Text[Length-1-i]:Text[i], &Dirty);
+		
+		for(; NbPad && Status==STATUS_OK; NbPad--)
+			Status=printf_putc(FILENR_FIRST_FUNC_ARG ' ', &Dirty);
+	}
+	
+	va_end(args);
+	
+	if(Dirty)
+		write_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
+	
+	return Status;
+}
+#endif
+
+#if !FS32_NO_SEEK_TELL
+FS32_status_t f_seek(const uint8_t filenr, const uint32_t pos)
+{
+	
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	if(OpenFiles[FILENR_ARR_INDEX].Mode!=FILE_READ && OpenFiles[FILENR_ARR_INDEX].Mode!=FILE_MODIFY)
+		return SEEK_CANT_SEEK_IN_THIS_MODE;
+	
+	if(pos>=OpenFiles[FILENR_ARR_INDEX].FileSize && pos!=FS_SEEK_END)
+		return SEEK_INVALID_POS;
+		
+	set_file_pos(FILENR_FIRST_FUNC_ARG pos);
+	
+	return STATUS_OK;
+}
+
+uint32_t f_tell(const uint8_t filenr)
+{
+	
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	return OpenFiles[FILENR_ARR_INDEX].PosInFile;
+}
+#endif
+
+#if FS32_RECORD_SUPPORT
+//maps more sectors of the file by following the chain after the last mapped one, a FAT sector is only read again when the chain leaves it
+static void record_map_extend(record_map_t * const map)
+{
+	record_extent_t * Extent=&map->Extents[map->NbExtents-1];
+	uint32_t Cluster=Extent->Cluster+(map->NbSectorsMapped-1-Extent->FileSector);
+	uint32_t CurrentFATSector=0;
+	
+	while(1)
+	{
+		pos_fat32_entry_t p=get_pos_fat_entry(Cluster);
+		if(p.FAT_SectorNumber!=CurrentFATSector)
+		{
+			SD_READ_SECTOR(p.FAT_SectorNumber, Buffer);
+			CurrentFATSector=p.FAT_SectorNumber;
+		}
+		
+		uint32_t NextCluster=((fat32_entry_t*)Buffer)[p.FAT_EntryIndex]&0x0FFFFFFF;
+		if(NextCluster<2 || NextCluster>TotalNbOfDataSectors+1) //end of chain
+			return;
 		
-		for(; EntryIndex<128; EntryIndex++)
+		if(NextCluster!=Cluster+1)
 		{
-			if(Sector==RsvdSecCnt+FATSz32 && EntryIndex>FATIndexLastEntry)
-				break;
-			
-			if((((fat32_entry_t*)Buffer)[EntryIndex]&0x0FFFFFFF)==0x00000000)
-			{
-				Found=true;
-				LastAllocatedSector=(Sector-RsvdSecCnt)*128+EntryIndex;
-				break;
-			}
+			if(map->NbExtents==FS32_RECORD_EXTENTS)
+				return; //table is full, the rest of the chain is followed on every access
+			Extent++;
+			map->NbExtents++;
+			Extent->FileSector=map->NbSectorsMapped;
+			Extent->Cluster=NextCluster;
 		}
-		if(Found)
-			break;
 		
-		EntryIndex=0;
+		map->NbSectorsMapped++;
+		Cluster=NextCluster;
 	}
+}
+
+static void record_map_init(record_map_t * const map, const uint32_t first_cluster)
+{
+	map->Extents[0].FileSector=0;
+	map->Extents[0].Cluster=first_cluster;
+	map->NbExtents=1;
+	map->NbSectorsMapped=1;
+	record_map_extend(map);
+}
+
+//forget the sectors freed by f_truncate(), nb_sectors is at least 1
+static void record_map_clip(record_map_t * const map, const uint32_t nb_sectors)
+{
+	if(map->NbSectorsMapped>nb_sectors)
+		map->NbSectorsMapped=nb_sectors;
 	
-	update_fsinfo();
+	while(map->NbExtents>1 && map->Extents[map->NbExtents-1].FileSector>=map->NbSectorsMapped)
+		map->NbExtents--;
+}
 
-	return p;
+static uint32_t record_map_lookup(record_map_t const * const map, const uint32_t file_sector)
+{
+	uint8_t i=map->NbExtents-1;
+	
+	if(file_sector<map->NbSectorsMapped)
+	{
+		while(map->Extents[i].FileSector>file_sector)
+			i--;
+		return map->Extents[i].Cluster+(file_sector-map->Extents[i].FileSector);
+	}
+	
+	//behind a full table
+	uint32_t Cluster=map->Extents[i].Cluster+(map->NbSectorsMapped-1-map->Extents[i].FileSector);
+	uint32_t NbSectors=file_sector-(map->NbSectorsMapped-1);
+	while(NbSectors--)
+		Cluster=fat32_get_next_sector(Cluster);
+	
+	return Cluster;
 }
-#endif
 
-#if !FS32_NO_WRITE
-static bool create_dir_entry(ONLY_ARG_FILENR) //always in root-directory!
-{	
-	uint32_t previous_cl=RootSector;
-	uint32_t cl=RootSector;
+//like set_file_pos() but the sector is taken from the extent table instead of following the chain from the beginning
+static void record_map_set_file_pos(FIRST_ARG_FILENR record_map_t const * const map, const uint32_t pos)
+{
+	OpenFiles[FILENR_ARR_INDEX].PosInFile=pos;
+	OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=pos&SECTOR_MASK;
 	
-	bool FoundFreeEntry=false;
+	uint32_t NbSectors=pos>>SECTOR_SHIFT;
 	
-	fat32_directory_entry_t DirEntry;
-	uint8_t Index=0;
+	if(NbSectors && pos==OpenFiles[FILENR_ARR_INDEX].FileSize && OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector==0)
+	{
+		//end of file is at the end of the last sector of the chain, stay there, f_write() will append a new sector
+		NbSectors--;
+		OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=FS32_SECTOR_SIZE;
+	}
 	
-	while(!IS_EOC_MARKER(cl))
+	OpenFiles[FILENR_ARR_INDEX].LogicalSector=record_map_lookup(map, NbSectors);
+}
+
+FS32_status_t f_open_records(uint8_t * const filenr, char const * const filename, const uint16_t record_size)
+{
+	if(!record_size)
+		return RECORD_INVALID_SIZE;
+	
+	FS32_status_t Status=f_open(filenr, filename, 'm');
+	if(Status!=STATUS_OK)
+		return Status;
+	
+	if(OpenFiles[FILENR_PTR_ARR_INDEX].FirstLogicalSector<2)
 	{
-		read_logical_sector(cl, Buffer);
+		//empty file created by a PC, it has no cluster yet, f_write() could not add the first record
+#if FS32_ALLOCATION_UNIT_SECTORS
+		fat32_goto_free_allocation_unit();
+#endif
+		pos_fat32_entry_t FATEntry=fat32_get_next_free_entry();
 		
-		for(Index=0; Index<512/sizeof(fat32_directory_entry_t); Index++)
+		if(FATEntry.noFreeSpace)
 		{
-			memcpy(&DirEntry, &(((fat32_directory_entry_t*)Buffer)[Index]), sizeof(fat32_directory_entry_t));
-			
-			if((uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE || (uint8_t)DirEntry.DIR_Name[0]==DIR_ENTRY_FREE_NO_MORE_DIR)
-			{
-				FoundFreeEntry=true;
-				break;
-			}
+			f_close(*filenr);
+			return OPEN_NO_MORE_SPACE;
 		}
 		
-		if(FoundFreeEntry)
-			break;
-		
-		previous_cl=cl;
-		cl=fat32_get_next_sector(cl);
-	}
-	
-	if(!FoundFreeEntry)
-	{
-		pos_fat32_entry_t p_curr=get_pos_fat_entry(previous_cl);
-		pos_fat32_entry_t p_new=fat32_get_next_free_entry();
-		if(p_new.noFreeSpace)
-			return true;
-		fat32_write_entry(&p_curr, p_new.LogicalSector);
-		fat32_write_entry(&p_new, EndOfClusterChainMarker);
-		cl=p_new.LogicalSector;
-		Index=0;
+		fat32_write_entry(&FATEntry, EndOfClusterChainMarker);
 		
-		memset(Buffer, DIR_ENTRY_FREE_NO_MORE_DIR, 512);
+		OpenFiles[FILENR_PTR_ARR_INDEX].FirstLogicalSector=FATEntry.LogicalSector;
+		OpenFiles[FILENR_PTR_ARR_INDEX].LogicalSector=FATEntry.LogicalSector;
+		set_dir_entry_cluster_and_size(&OpenFiles[FILENR_PTR_ARR_INDEX], FATEntry.LogicalSector, 0);
 	}
 	
-	memset(&DirEntry, 0, sizeof(fat32_directory_entry_t));
-	filename_to_fat32(FILENR_ARR_INDEX, &DirEntry);
-	DirEntry.DIR_WrtTime=rtc_get_encoded_time();
-	DirEntry.DIR_WrtDate=rtc_get_encoded_date();
-	DirEntry.DIR_FileSize=OpenFiles[FILENR_ARR_INDEX].FileSize;
-	DirEntry.DIR_FstClusHI=OpenFiles[FILENR_ARR_INDEX].FirstLogicalSector>>16;
-	DirEntry.DIR_FstClusLO=OpenFiles[FILENR_ARR_INDEX].FirstLogicalSector&0xFFFF;
-	
-	memcpy(&(((fat32_directory_entry_t*)Buffer)[Index]), &DirEntry, sizeof(fat32_directory_entry_t));
+	RecordMaps[FILENR_PTR_ARR_INDEX].RecordSize=record_size;
+	record_map_init(&RecordMaps[FILENR_PTR_ARR_INDEX], OpenFiles[FILENR_PTR_ARR_INDEX].FirstLogicalSector);
 	
-	write_logical_sector(cl, Buffer);
-		
-	return false;
+	return STATUS_OK;
 }
-#endif
 
-#if !FS32_NO_APPEND || !FS32_NO_MODIFY
-static void update_dir_entry(ONLY_ARG_FILENR)
+FS32_status_t f_read_record(const uint8_t filenr, const uint32_t index, void * ptr)
 {
-	read_logical_sector(OpenFiles[FILENR_ARR_INDEX].SectorDirEntry, Buffer);
 	
-	fat32_directory_entry_t * Entry=(fat32_directory_entry_t*)Buffer;
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	record_map_t const * const Map=&RecordMaps[FILENR_ARR_INDEX];
 	
-	Entry[OpenFiles[FILENR_ARR_INDEX].IndexDirEntry].DIR_FileSize=OpenFiles[FILENR_ARR_INDEX].FileSize;
-	Entry[OpenFiles[FILENR_ARR_INDEX].IndexDirEntry].DIR_WrtTime=rtc_get_encoded_time();
-	Entry[OpenFiles[FILENR_ARR_INDEX].IndexDirEntry].DIR_WrtDate=rtc_get_encoded_date();
+	if(!Map->RecordSize)
+		return RECORD_NO_OPEN_FILE;
+	
+	if(index>=OpenFiles[FILENR_ARR_INDEX].FileSize/Map->RecordSize)
+		return RECORD_INVALID_INDEX;
+	
+	uint32_t Pos=index*Map->RecordSize;
+	uint16_t NbBytesToRead=Map->RecordSize;
+	
+	while(NbBytesToRead)
+	{
+		uint16_t PosInSector=Pos&SECTOR_MASK;
+		uint16_t NbToCopy=FS32_SECTOR_SIZE-PosInSector;
+		if(NbToCopy>NbBytesToRead)
+			NbToCopy=NbBytesToRead;
+		
+		read_logical_sector(record_map_lookup(Map, Pos>>SECTOR_SHIFT), Buffer);
+		memcpy(ptr, Buffer+PosInSector, NbToCopy);
+		
+		ptr+=NbToCopy;
+		Pos+=NbToCopy;
+		NbBytesToRead-=NbToCopy;
+	}
 	
-	write_logical_sector(OpenFiles[FILENR_ARR_INDEX].SectorDirEntry, Buffer);
+	return STATUS_OK;
 }
-#endif
 
-#if !FS32_NO_APPEND || !FS32_NO_SEEK_TELL
-static void set_file_pos(FIRST_ARG_FILENR uint32_t pos)
+FS32_status_t f_write_record(const uint8_t filenr, const uint32_t index, void const * ptr)
 {
-	if(pos==FS_SEEK_END)
-		pos=OpenFiles[FILENR_ARR_INDEX].FileSize;
 	
-	OpenFiles[FILENR_ARR_INDEX].PosInFile=pos;
-	OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=pos%512;
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	record_map_t * const Map=&RecordMaps[FILENR_ARR_INDEX];
 	
-	uint16_t NbSectors=pos/512;
+	if(!Map->RecordSize)
+		return RECORD_NO_OPEN_FILE;
 	
-	uint32_t sector=OpenFiles[FILENR_ARR_INDEX].FirstLogicalSector;
+	if(index>OpenFiles[FILENR_ARR_INDEX].FileSize/Map->RecordSize)
+		return RECORD_INVALID_INDEX; //only the next record can be added
 	
-	while(NbSectors--)
-		sector=fat32_get_next_sector(sector);
+	uint32_t Pos=index*Map->RecordSize;
 	
-	OpenFiles[FILENR_ARR_INDEX].LogicalSector=sector;
+	if(Pos+Map->RecordSize>OpenFiles[FILENR_ARR_INDEX].FileSize)
+	{
+		//the file grows, let f_write() allocate the clusters, appending one record after the other keeps the position at the end
+		//(PosInLogicalSector is 0 at the end of the file after f_read() went past the last sector)
+		if(OpenFiles[FILENR_ARR_INDEX].PosInFile!=Pos || OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector==0)
+			record_map_set_file_pos(FILENR_FIRST_FUNC_ARG Map, Pos);
+		
+		FS32_status_t Status=f_write(filenr, ptr, Map->RecordSize, 1);
+		
+		record_map_extend(Map);
+		
+		return Status;
+	}
+	
+	uint16_t NbBytesToWrite=Map->RecordSize;
+	
+	while(NbBytesToWrite)
+	{
+		uint16_t PosInSector=Pos&SECTOR_MASK;
+		uint16_t NbToCopy=FS32_SECTOR_SIZE-PosInSector;
+		if(NbToCopy>NbBytesToWrite)
+			NbToCopy=NbBytesToWrite;
+		
+		uint32_t Sector=record_map_lookup(Map, Pos>>SECTOR_SHIFT);
+		if(NbToCopy!=FS32_SECTOR_SIZE) //a sector covered by the record is not read
+			read_logical_sector(Sector, Buffer);
+		memcpy(Buffer+PosInSector, ptr, NbToCopy);
+		write_logical_sector(Sector, Buffer);
+		
+		ptr+=NbToCopy;
+		Pos+=NbToCopy;
+		NbBytesToWrite-=NbToCopy;
+	}
+	
+	return STATUS_OK;
 }
 #endif
 
-#if !SINGLE_FILE_CONFIG
-static int8_t get_free_slot(void)
+#if FS32_IDLE_STEP_SUPPORT
+uint16_t f_idle_step(const uint16_t budget_sectors)
 {
-	uint8_t i;
-	for(i=0; i<FS32_NB_FILES_MAX; i++)
+	uint16_t NbSectorsUsed=0;
+	
+#if FS32_REALTIME_WRITE
+	if(FSInfoDirty && budget_sectors>=2)
 	{
-		if(!OpenFiles[i].isInUse)
-			return i;
+		update_fsinfo();
+		NbSectorsUsed=2;
 	}
+#endif
+
+#if FAT_MIRROR
+	NbSectorsUsed+=fat32_mirror_sync(budget_sectors-NbSectorsUsed);
+#endif
 	
-	return -1;
+	NbSectorsUsed+=refill_free_cluster_cache(budget_sectors-NbSectorsUsed);
+	
+	if(NbSectorsUsed<budget_sectors)
+		NbSectorsUsed+=recount_free_clusters(budget_sectors-NbSectorsUsed);
+	
+	return NbSectorsUsed;
+}
+#endif
+
+#if FAT_MIRROR || FS32_WRITEBACK_SECTORS
+void f_sync(void)
+{
+#if FS32_REALTIME_WRITE
+	if(FSInfoDirty)
+		update_fsinfo();
+#endif
+
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF);
+#endif
+
+#if FS32_WRITEBACK_SECTORS
+	writeback_flush();
+#endif
 }
 #endif
 
-static bool check_if_already_open(char const * const name)
+#if FS32_SNAPSHOT_SUPPORT
+FS32_status_t f_unmount(void)
 {
 	uint8_t i;
 	for(i=0; i<FS32_NB_FILES_MAX; i++)
 	{
-		if(OpenFiles[i].isInUse && !strcmp(OpenFiles[i].Name, name))
-			return true;
+		if(OpenFiles[i].Mode!=FILE_CLOSED)
+			return UNMOUNT_FILES_OPEN;
 	}
 	
-	return false;
-}
+	update_fsinfo(); //the snapshot is only used again if FSINFO holds the same values
+	
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF);
+#endif
 
-//public functions
+#if FS32_WRITEBACK_SECTORS
+	writeback_flush();
+#endif
+	
+	if(!SnapshotSector)
+		return UNMOUNT_NO_SNAPSHOT_SECTOR;
+	
+	memset(Buffer, 0, FS32_SECTOR_SIZE);
+	fs32_snapshot_t * const Snapshot=(fs32_snapshot_t*)Buffer;
+	Snapshot->Magic=SNAPSHOT_MAGIC;
+	Snapshot->VolumeID=VolumeID;
+	Snapshot->State=SNAPSHOT_STATE_CLEAN;
+	Snapshot->NbFreeSectors=NbFreeSectors;
+	Snapshot->LastAllocatedSector=LastAllocatedSector;
+	Snapshot->GroupSectors=SnapshotGroupSectors;
+	memcpy(Snapshot->GroupFree, GroupFree, sizeof(GroupFree));
+	Snapshot->Checksum=snapshot_checksum(Buffer);
+	SD_WRITE_SECTOR_NOW(SnapshotSector, Buffer); //last, everything it describes is on the card now
+	
+	return STATUS_OK;
+}
+#endif
 
-#if FS32_PARTITION_SUPPORT
-FS32_status_t f_set_partition(const uint8_t partition)
+#if !FS32_NO_UNLINK
+FS32_status_t f_unlink(char const * const filename)
 {
-	if(partition>3)
-		return SET_PART_INVALID_NUMBER;
+	file_t File;
+	if(!resolve_path(filename, &File.DirCluster, File.RawName))
+		return UNLINK_FILE_NOT_FOUND;
 	
-	sd_read_sector(0, Buffer);
-	master_boot_record_t *mbr=(master_boot_record_t*)Buffer;
+	if(check_if_already_open(File.DirCluster, File.RawName))
+		return UNLINK_FILE_IS_OPEN;
 	
-	if(mbr->BootSignature!=0xAA55)
-		return SET_PART_INVALID_BOOT_SIG;
+	search_result_t Result=fat32_search_in_dir(File.DirCluster, File.RawName, &File);
 	
-	if(mbr->Partitions[partition].PartitionType!=0x0C)
-		return SET_PART_UNKNOWN_PART_TYPE;
+	if(Result==SEARCH_FOUND_DIR)
+		return UNLINK_IS_DIRECTORY;
 	
-	if(mbr->Partitions[partition].NumberOfSectors==0)
-		return SET_PART_NO_VALID_PART;
+	if(Result!=SEARCH_FOUND_FILE)
+		return UNLINK_FILE_NOT_FOUND;
 	
-	StartOfPartition=mbr->Partitions[partition].StartSectorLBA;
+	//directory entry first so a power loss can only leave lost clusters behind, not an entry pointing to free clusters
+	delete_dir_entry(&File);
+	
+	if(File.FirstLogicalSector>=2) //an empty file created by a PC has no cluster
+		fat32_free_chain(File.FirstLogicalSector, false);
+	
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF); //no file is open, f_close() would never copy the changes to the second FAT
+#endif
 	
 	return STATUS_OK;
 }
 #endif
 
-FS32_status_t f_init(void)
+#if !FS32_NO_TRUNCATE
+FS32_status_t f_truncate(const uint8_t filenr, const uint32_t size)
 {
-	uint8_t i;
-	for(i=0; i<FS32_NB_FILES_MAX; i++)
-		OpenFiles[i].isInUse=false;
 	
-	SD_READ_SECTOR(0, Buffer);
+#if SINGLE_FILE_CONFIG
+	(void)filenr;
+#endif
+
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_CLOSED)
+		return TRUNCATE_NO_OPEN_FILE;
 	
-	fat32_header_t *header=(fat32_header_t*)Buffer;
+	if(OpenFiles[FILENR_ARR_INDEX].Mode==FILE_READ)
+		return TRUNCATE_FILE_READ_ONLY;
 	
-	if(header->BS_jmpBoot[0]!=0xEB)
-		return INIT_INVALID_JUMP;
-		
-	if(header->BPB_BytsPerSec!=512)
-		return INIT_INVALID_BYTES_PER_SEC;
+	if(size>OpenFiles[FILENR_ARR_INDEX].FileSize)
+		return TRUNCATE_INVALID_SIZE;
 	
-	if(header->BPB_SecPerClus!=1)
-		return INIT_INVALID_SEC_PER_CLUS;
+	OpenFiles[FILENR_ARR_INDEX].FileSize=size;
 	
-	if(header->BPB_TotSec16)
-		return INIT_NOT_FAT32;
+	if(OpenFiles[FILENR_ARR_INDEX].PosInFile>size)
+		set_file_pos(FILENR_FIRST_FUNC_ARG size);
 	
-	if(header->BPB_FATSz16)
-		return INIT_NOT_FAT32;
-		
-	if(header->BPB_NumFATs!=1)
-		return INIT_MULTIPLE_FAT;
-
-	RsvdSecCnt=header->BPB_RsvdSecCnt;
-	RootSector=header->BPB_RootClus;
-	FATSz32=header->BPB_FATSz32;
-	FirstDataSector=header->BPB_RsvdSecCnt+header->BPB_FATSz32;
-	TotalNbOfDataSectors=header->BPB_TotSec32-FirstDataSector;
-	FATIndexLastEntry=TotalNbOfDataSectors%128;
+#if !FS32_NO_APPEND || !FS32_NO_MODIFY
+	if(OpenFiles[FILENR_ARR_INDEX].Mode!=FILE_NEW)
+		update_dir_entry(FILENR_ONLY_FUNC_ARG); //shrink the file before freeing its clusters
+#endif
 	
-	//FAT EOC-Marker
-	sd_read_sector(header->BPB_RsvdSecCnt, Buffer);
-	EndOfClusterChainMarker=((fat32_entry_t*)Buffer)[1];
+	uint32_t NbSectorsToKeep=(size+SECTOR_MASK)>>SECTOR_SHIFT;
+	if(NbSectorsToKeep==0)
+		NbSectorsToKeep=1; //a file created by this code always has at least one cluster
 	
-	//FSINFO
-	SD_READ_SECTOR(1, Buffer);
-	fat32_fsinfo_t *fsinfo=(fat32_fsinfo_t*)Buffer;
+#if FS32_RECORD_SUPPORT
+	if(RecordMaps[FILENR_ARR_INDEX].RecordSize)
+		record_map_clip(&RecordMaps[FILENR_ARR_INDEX], NbSectorsToKeep);
+#endif
 	
-	if(fsinfo->FSI_LeadSig!=FSI_LEADSIG)
-		return INIT_INVALID_FSINFO;
+	uint32_t LastSector=OpenFiles[FILENR_ARR_INDEX].FirstLogicalSector;
+	while(--NbSectorsToKeep)
+		LastSector=fat32_get_next_sector(LastSector);
 	
-	NbFreeSectors=fsinfo->FSI_Free_Count;
-	LastAllocatedSector=fsinfo->FSI_Last_Allocated;
+	if(!IS_EOC_MARKER(fat32_get_next_sector(LastSector)))
+		fat32_free_chain(LastSector, true);
+	
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF); //don't wait for f_close(), the file may stay open for a long time
+#endif
 	
 	return STATUS_OK;
 }
+#endif
 
-FS32_status_t f_open(uint8_t * const filenr, char const * const filename, const char mode)
+#if FS32_DEFRAG_SUPPORT
+FS32_status_t f_defrag(char const * const filename, uint32_t * const fragments_before, uint32_t * const fragments_after)
 {
-	if(check_if_already_open(filename))
-		return OPEN_FILE_ALREADY_OPEN;
+	file_t File;
+	if(!resolve_path(filename, &File.DirCluster, File.RawName))
+		return DEFRAG_FILE_NOT_FOUND;
 	
-#if !SINGLE_FILE_CONFIG	
-	int8_t slot=get_free_slot();
-	if(slot<0)
-		return OPEN_NO_FREE_SLOT;
-		
-	(*filenr)=(uint8_t)slot;
-#else
-	(void)filenr;
-	if(OpenFiles[FILENR_ARR_INDEX].isInUse)
-		return OPEN_NO_FREE_SLOT;
+	if(check_if_already_open(File.DirCluster, File.RawName))
+		return DEFRAG_FILE_IS_OPEN;
+	
+	search_result_t Result=fat32_search_in_dir(File.DirCluster, File.RawName, &File);
+	
+	if(Result==SEARCH_FOUND_DIR)
+		return DEFRAG_IS_DIRECTORY;
+	
+	if(Result!=SEARCH_FOUND_FILE)
+		return DEFRAG_FILE_NOT_FOUND;
+	
+	uint32_t NbClusters=0;
+	uint32_t NbFragments=0;
+	
+	if(File.FirstLogicalSector>=2)
+		fat32_get_chain_layout(File.FirstLogicalSector, &NbClusters, &NbFragments);
+	
+	(*fragments_before)=NbFragments;
+	(*fragments_after)=NbFragments;
+	
+	if(NbFragments<=1)
+		return STATUS_OK;
+	
+	uint32_t NewFirstSector=fat32_find_free_run(NbClusters);
+	if(!NewFirstSector)
+		return DEFRAG_NO_CONTIGUOUS_SPACE;
+	
+	//The order matters: Until the directory entry is updated the old chain is still valid, a power loss only leaves lost clusters behind.
+	
+	uint32_t OldSector=File.FirstLogicalSector;
+	uint32_t i;
+	for(i=0; i<NbClusters; i++)
+	{
+		if(i)
+			OldSector=fat32_get_next_sector(OldSector);
+		read_logical_sector(OldSector, Buffer);
+		write_logical_sector(NewFirstSector+i, Buffer);
+	}
+	
+	fat32_write_contiguous_chain(NewFirstSector, NbClusters);
+	
+	read_logical_sector(File.SectorDirEntry, Buffer);
+	((fat32_directory_entry_t*)Buffer)[File.IndexDirEntry].DIR_FstClusHI=NewFirstSector>>16;
+	((fat32_directory_entry_t*)Buffer)[File.IndexDirEntry].DIR_FstClusLO=NewFirstSector&0xFFFF;
+	write_dir_sector(File.SectorDirEntry, Buffer);
+	
+	fat32_free_chain(File.FirstLogicalSector, false); //also updates FSINFO
+	
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF);
+#endif
+	
+	(*fragments_after)=1;
+	
+	return STATUS_OK;
+}
 #endif
 
-	fat32_search_for_file(FILENR_PTR_FUNC_ARG filename);
+#if FS32_CONCAT_SUPPORT
+static FS32_status_t concat_files(char const * const dst, char const * const src)
+{
+	file_t Dst, Src;
+	if(!resolve_path(dst, &Dst.DirCluster, Dst.RawName) || !resolve_path(src, &Src.DirCluster, Src.RawName))
+		return CONCAT_FILE_NOT_FOUND;
+	
+	if(Dst.DirCluster==Src.DirCluster && !memcmp(Dst.RawName, Src.RawName, 8+3))
+		return CONCAT_SAME_FILE;
+	
+	if(check_if_already_open(Dst.DirCluster, Dst.RawName) || check_if_already_open(Src.DirCluster, Src.RawName))
+		return CONCAT_FILE_IS_OPEN;
+	
+	if(fat32_search_in_dir(Dst.DirCluster, Dst.RawName, &Dst)!=SEARCH_FOUND_FILE || fat32_search_in_dir(Src.DirCluster, Src.RawName, &Src)!=SEARCH_FOUND_FILE)
+		return CONCAT_FILE_NOT_FOUND;
+	
+	if(Dst.FileSize+Src.FileSize<Dst.FileSize)
+		return CONCAT_FILE_TOO_BIG;
 	
-#if !FS32_NO_READ
-	if(mode=='r')
+	//The order matters: src is removed from the directory before its clusters become part of dst, a power loss can leave lost clusters behind or a chain longer than the file but never two files sharing clusters.
+	
+	if(Dst.FileSize==0 || Dst.FirstLogicalSector<2)
 	{
-		if(OpenFiles[FILENR_PTR_ARR_INDEX].FileFound==false)
-			return OPEN_FILE_NOT_FOUND;
-		
-		OpenFiles[FILENR_PTR_ARR_INDEX].isNewFile=false;
-		OpenFiles[FILENR_PTR_ARR_INDEX].OpenedForReading=true;
-		OpenFiles[FILENR_PTR_ARR_INDEX].PosInFile=0;
-		OpenFiles[FILENR_PTR_ARR_INDEX].PosInLogicalSector=0;
+		//dst is empty, it simply takes over the chain of src
+		delete_dir_entry(&Src);
+		set_dir_entry_cluster_and_size(&Dst, Src.FirstLogicalSector, Src.FileSize);
+		if(Dst.FirstLogicalSector>=2)
+			fat32_free_chain(Dst.FirstLogicalSector, false);
+		return STATUS_OK;
 	}
-	else
-#endif
-#if !FS32_NO_WRITE
-	if(mode=='w')
+	
+	uint32_t LastSector=Dst.FirstLogicalSector;
+	uint32_t NbSectors=(Dst.FileSize-1)>>SECTOR_SHIFT;
+	while(NbSectors--)
+		LastSector=fat32_get_next_sector(LastSector);
+	
+	if(!IS_EOC_MARKER(fat32_get_next_sector(LastSector))) //chain is longer than needed, not done by this code
+		fat32_free_chain(LastSector, true);
+	
+	if((Dst.FileSize&SECTOR_MASK)==0)
 	{
-		if(OpenFiles[FILENR_PTR_ARR_INDEX].FileFound==true)
-			return OPEN_FILE_ALREADY_EXISTS;
-		else
+		//zero-copy: link the last cluster of dst to the first cluster of src
+		delete_dir_entry(&Src);
+		if(Src.FileSize && Src.FirstLogicalSector>=2)
 		{
-			pos_fat32_entry_t FATEntry=fat32_get_next_free_entry();
-			
-			if(FATEntry.noFreeSpace)
-				return OPEN_NO_MORE_SPACE;
-			
-			memset(&OpenFiles[FILENR_PTR_ARR_INDEX], 0, sizeof(file_t));
-			OpenFiles[FILENR_PTR_ARR_INDEX].isInUse=true;
-			OpenFiles[FILENR_PTR_ARR_INDEX].isNewFile=true;
-			OpenFiles[FILENR_PTR_ARR_INDEX].FirstLogicalSector=FATEntry.LogicalSector;
-			OpenFiles[FILENR_PTR_ARR_INDEX].LogicalSector=FATEntry.LogicalSector;
-			
-			strncpy(OpenFiles[FILENR_PTR_ARR_INDEX].Name, filename, 8+1+3);
-			
-			fat32_write_entry(&FATEntry, EndOfClusterChainMarker);
+			pos_fat32_entry_t p=get_pos_fat_entry(LastSector);
+			fat32_write_entry(&p, Src.FirstLogicalSector);
 		}
-	} else
-#endif
-#if !FS32_NO_APPEND
-	if(mode=='a')
+		else if(Src.FirstLogicalSector>=2)
+			fat32_free_chain(Src.FirstLogicalSector, false);
+		set_dir_entry_cluster_and_size(&Dst, Dst.FirstLogicalSector, Dst.FileSize+Src.FileSize);
+		return STATUS_OK;
+	}
+	
+	//The data of src does not begin on a sector boundary inside dst and FAT can't express that, so it has to be copied. SecondBuffer holds the sector of dst being filled while Buffer is used for reading src and the FAT.
+	
+	read_logical_sector(LastSector, SecondBuffer);
+	
+	uint32_t CurrentSector=LastSector;
+	uint16_t Fill=Dst.FileSize&SECTOR_MASK;
+	uint32_t SrcSector=Src.FirstLogicalSector;
+	uint32_t Remaining=Src.FileSize;
+	
+	while(Remaining)
 	{
-		if(OpenFiles[FILENR_PTR_ARR_INDEX].FileFound==false)
-			return OPEN_FILE_NOT_FOUND;
+		read_logical_sector(SrcSector, Buffer);
 		
-		OpenFiles[FILENR_PTR_ARR_INDEX].isInUse=true;
-		OpenFiles[FILENR_PTR_ARR_INDEX].isNewFile=false;
-		OpenFiles[FILENR_PTR_ARR_INDEX].OpenedForReading=false;
-		OpenFiles[FILENR_PTR_ARR_INDEX].OpenendForAppending=true;
+		uint16_t NbBytes=(Remaining<FS32_SECTOR_SIZE)?Remaining:FS32_SECTOR_SIZE;
+		uint16_t NbFirst=FS32_SECTOR_SIZE-Fill;
+		if(NbFirst>NbBytes)
+			NbFirst=NbBytes;
 		
-		set_file_pos(FILENR_PTR_FUNC_ARG OpenFiles[FILENR_PTR_ARR_INDEX].FileSize);
-	} else
-#endif
-#if !FS32_NO_MODIFY
-	if(mode=='m')
-	{
-		if(OpenFiles[FILENR_PTR_ARR_INDEX].FileFound==false)
-			return OPEN_FILE_NOT_FOUND;
+		memcpy(&SecondBuffer[Fill], Buffer, NbFirst);
+		Fill+=NbFirst;
+		Remaining-=NbBytes;
 		
-		OpenFiles[FILENR_PTR_ARR_INDEX].isInUse=true;
-		OpenFiles[FILENR_PTR_ARR_INDEX].isNewFile=false;
-		OpenFiles[FILENR_PTR_ARR_INDEX].OpenedForReading=false;
-		OpenFiles[FILENR_PTR_ARR_INDEX].OpenendForAppending=false;
-		OpenFiles[FILENR_PTR_ARR_INDEX].OpenendForModify=true;
-		OpenFiles[FILENR_PTR_ARR_INDEX].PosInFile=0;
-		OpenFiles[FILENR_PTR_ARR_INDEX].PosInLogicalSector=0;
-	} else
-#endif
-		return OPEN_INVALID_MODE;
+		if(Fill==FS32_SECTOR_SIZE)
+		{
+			write_logical_sector(CurrentSector, SecondBuffer);
+			
+			Fill=NbBytes-NbFirst;
+			memcpy(SecondBuffer, &Buffer[NbFirst], Fill); //before Buffer gets overwritten by the FAT
+			
+			if(Fill || Remaining)
+			{
+				pos_fat32_entry_t p_curr=get_pos_fat_entry(CurrentSector);
+				pos_fat32_entry_t p_new=fat32_get_next_free_entry();
+				if(p_new.noFreeSpace)
+				{
+					if(CurrentSector!=LastSector) //give back what was added, dst is unchanged
+						fat32_free_chain(LastSector, true);
+					return CONCAT_NO_MORE_SPACE;
+				}
+				fat32_append_cluster(&p_curr, &p_new);
+				CurrentSector=p_new.LogicalSector;
+			}
+		}
+		
+		if(Remaining)
+			SrcSector=fat32_get_next_sector(SrcSector);
+	}
+	
+	if(Fill)
+		write_logical_sector(CurrentSector, SecondBuffer);
+	
+	set_dir_entry_cluster_and_size(&Dst, Dst.FirstLogicalSector, Dst.FileSize+Src.FileSize);
+	delete_dir_entry(&Src);
+	if(Src.FirstLogicalSector>=2)
+		fat32_free_chain(Src.FirstLogicalSector, false);
 	
 	return STATUS_OK;
 }
 
-FS32_status_t f_close(const uint8_t filenr)
+FS32_status_t f_concat(char const * const dst, char const * const src)
 {
+	FS32_status_t Status=concat_files(dst, src);
 	
-#if SINGLE_FILE_CONFIG
-	(void)filenr;
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF); //also after an error, clusters may have been added and given back
 #endif
-
-	if(!OpenFiles[FILENR_ARR_INDEX].isInUse)
-		return STATUS_OK;
 	
-	OpenFiles[FILENR_ARR_INDEX].isInUse=false;
-	
-#if !FS32_NO_WRITE	
-	if(OpenFiles[FILENR_ARR_INDEX].isNewFile)
-	{
-		if(create_dir_entry(FILENR_ONLY_FUNC_ARG))
-			return CLOSE_CREATE_DIR_ENTRY_FAILED;
-	}
+	return Status;
+}
 #endif
 
-#if !FS32_NO_APPEND || !FS32_NO_MODIFY
-	if(OpenFiles[FILENR_ARR_INDEX].OpenendForAppending || OpenFiles[FILENR_ARR_INDEX].OpenendForModify)
+#if FS32_COMPACT_ROOT_SUPPORT
+FS32_status_t f_compact_root(void)
+{
+	uint8_t i;
+	for(i=0; i<FS32_NB_FILES_MAX; i++)
 	{
-		update_dir_entry(FILENR_ONLY_FUNC_ARG);
+		if(OpenFiles[i].Mode!=FILE_CLOSED) //position of the directory entry is stored inside the handle
+			return COMPACT_FILES_OPEN;
 	}
+	
+#if FS32_NAME_INDEX_SUPPORT
+	bool NameIndexWasValid=(NameIndexFirstCluster!=0);
+	NameIndexFirstCluster=0; //useless while entries are moved
 #endif
 	
-	return STATUS_OK;
-}
-
-#if !FS32_NO_READ
-FS32_status_t f_read(const uint8_t filenr, void * ptr, const uint16_t size, const uint16_t n)
-{
+	//Two cursors on the same chain: Entries are read from ReadSector and packed into SecondBuffer which is written to WriteSector once full. WriteSector can never pass ReadSector.
 	
-#if SINGLE_FILE_CONFIG
-	(void)filenr;
-#endif
-
-	uint32_t NbBytesToRead=(uint32_t)size*n;
+	uint32_t ReadSector=RootSector;
+	uint32_t WriteSector=RootSector;
+	uint32_t PreviousWriteSector=0;
+	uint8_t WriteIndex=0;
+	bool NoMoreEntries=false;
 	
-	while(NbBytesToRead && OpenFiles[FILENR_ARR_INDEX].PosInFile<OpenFiles[FILENR_ARR_INDEX].FileSize)
+	while(!IS_EOC_MARKER(ReadSector) && !NoMoreEntries)
 	{
-		uint32_t NbToCopy=NbBytesToRead;
-		if(NbToCopy>512-OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector)
-			NbToCopy=512-OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector;
-		if(NbToCopy>(OpenFiles[FILENR_ARR_INDEX].FileSize-OpenFiles[FILENR_ARR_INDEX].PosInFile))
-			NbToCopy=OpenFiles[FILENR_ARR_INDEX].FileSize-OpenFiles[FILENR_ARR_INDEX].PosInFile;
-
-		read_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
-		
-		memcpy(ptr, Buffer+OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector, NbToCopy);
+		read_logical_sector(ReadSector, Buffer);
 		
-		ptr+=NbToCopy;
-		OpenFiles[FILENR_ARR_INDEX].PosInFile+=NbToCopy;
-		OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector+=NbToCopy;
-		if(OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector>=512)
+		uint8_t ReadIndex;
+		for(ReadIndex=0; ReadIndex<DIR_ENTRIES_PER_SECTOR; ReadIndex++)
 		{
-			OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector-=512;
-			OpenFiles[FILENR_ARR_INDEX].LogicalSector=fat32_get_next_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector);
-			if(OpenFiles[FILENR_ARR_INDEX].LogicalSector==EndOfClusterChainMarker)
+			fat32_directory_entry_t * Entry=&((fat32_directory_entry_t*)Buffer)[ReadIndex];
+			
+			if((uint8_t)Entry->DIR_Name[0]==DIR_ENTRY_FREE_NO_MORE_DIR)
+			{
+				NoMoreEntries=true;
 				break;
+			}
+			
+			if((uint8_t)Entry->DIR_Name[0]==DIR_ENTRY_FREE)
+				continue;
+			
+			//everything else is kept in the same order, long name entries stay in front of their short name entry
+			memcpy(&((fat32_directory_entry_t*)SecondBuffer)[WriteIndex], Entry, sizeof(fat32_directory_entry_t));
+			WriteIndex++;
+			
+			if(WriteIndex==DIR_ENTRIES_PER_SECTOR)
+			{
+				write_dir_sector(WriteSector, SecondBuffer);
+				WriteIndex=0;
+				PreviousWriteSector=WriteSector;
+				WriteSector=fat32_get_next_sector(WriteSector); //overwrites Buffer
+				if(ReadIndex<DIR_ENTRIES_PER_SECTOR-1)
+					read_logical_sector(ReadSector, Buffer);
+			}
 		}
 		
-		NbBytesToRead-=NbToCopy;
+		if(!NoMoreEntries)
+			ReadSector=fat32_get_next_sector(ReadSector);
 	}
 	
-	if(NbBytesToRead)
-		return READ_FAILED;
-	else
-		return STATUS_OK;
-}
+	if(WriteIndex==0 && WriteSector!=RootSector && !IS_EOC_MARKER(WriteSector))
+	{
+		//the last used sector is full, the end of the chain marks the end of the directory
+		fat32_free_chain(PreviousWriteSector, true);
+	}
+	else if(!IS_EOC_MARKER(WriteSector)) //otherwise every sector is full, nothing to free
+	{
+		memset(&SecondBuffer[WriteIndex*sizeof(fat32_directory_entry_t)], DIR_ENTRY_FREE_NO_MORE_DIR, FS32_SECTOR_SIZE-WriteIndex*sizeof(fat32_directory_entry_t));
+		write_dir_sector(WriteSector, SecondBuffer);
+		
+		if(!IS_EOC_MARKER(fat32_get_next_sector(WriteSector)))
+			fat32_free_chain(WriteSector, true);
+	}
+	
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF);
 #endif
-
-#if !FS32_NO_APPEND || !FS32_NO_WRITE || !FS32_NO_MODIFY
-FS32_status_t f_write(const uint8_t filenr, void const * ptr, const uint16_t size, const uint16_t n)
-{
 	
-#if SINGLE_FILE_CONFIG
-	(void)filenr;
+#if FS32_NAME_INDEX_SUPPORT
+	if(NameIndexWasValid) //entries have moved
+		return f_index_rebuild();
 #endif
-
-	if(!OpenFiles[FILENR_ARR_INDEX].isInUse)
-		return WRITE_NO_OPEN_FILE;
 	
-	if(OpenFiles[FILENR_ARR_INDEX].OpenedForReading)
-		return WRITE_FILE_READ_ONLY;
+	return STATUS_OK;
+}
+#endif
+
+#if FS32_NAME_INDEX_SUPPORT
+FS32_status_t f_index_rebuild(void)
+{
+	NameIndexFirstCluster=0; //not used until the new index is complete
 	
-	uint32_t NbBytesToWrite=(uint32_t)size*n;
+	uint32_t NbClusters=1+FS32_NAME_INDEX_SECTORS; //header and hash table, must be contiguous
 	
+	file_t File;
+	bool FileFound=(fat32_search_for_file(NAME_INDEX_FILENAME, &File)==SEARCH_FOUND_FILE);
 	
-	while(NbBytesToWrite)
+	if(FileFound)
 	{
-		uint16_t NbBytesToCopy=512-OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector;
+		uint32_t NbClustersFile=0;
+		uint32_t NbFragments=0;
 		
-		bool IncreasingSize=false;
+		if(File.FirstLogicalSector>=2)
+			fat32_get_chain_layout(File.FirstLogicalSector, &NbClustersFile, &NbFragments);
 		
-		if(OpenFiles[FILENR_ARR_INDEX].PosInFile+NbBytesToWrite>OpenFiles[FILENR_ARR_INDEX].FileSize)
-			IncreasingSize=true;
+		if(File.FileSize!=NbClusters*FS32_SECTOR_SIZE || NbClustersFile!=NbClusters || NbFragments!=1) //other configuration or damaged
+		{
+			delete_dir_entry(&File);
+			if(File.FirstLogicalSector>=2)
+				fat32_free_chain(File.FirstLogicalSector, false);
+			FileFound=false;
+		}
+	}
+	
+	if(!FileFound)
+	{
+		uint32_t FirstCluster=fat32_find_free_run(NbClusters);
+		if(!FirstCluster)
+		{
+#if FAT_MIRROR
+			fat32_mirror_sync(0xFFFFFFFF); //the old index may have been freed
+#endif
+			return INDEX_NO_CONTIGUOUS_SPACE;
+		}
 		
-		if(NbBytesToCopy>NbBytesToWrite)
-			NbBytesToCopy=NbBytesToWrite;
+		fat32_write_contiguous_chain(FirstCluster, NbClusters);
+		update_fsinfo();
 		
-		if(NbBytesToCopy) //avoid reading a sector just to write it again without change
+		File.FirstLogicalSector=FirstCluster;
+		File.FileSize=NbClusters*FS32_SECTOR_SIZE;
+		
+		if(create_dir_entry(&File, ATTR_HIDDEN|ATTR_SYSTEM))
 		{
-			if(OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector!=0 || OpenFiles[FILENR_ARR_INDEX].OpenendForModify)
-				read_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
-			
-			memcpy(Buffer+OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector, ptr, NbBytesToCopy);
-			
-			write_logical_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector, Buffer);
-
-			NbBytesToWrite-=NbBytesToCopy;
-			ptr+=NbBytesToCopy;
-			
-			if(IncreasingSize)
-				OpenFiles[FILENR_ARR_INDEX].FileSize=OpenFiles[FILENR_ARR_INDEX].PosInFile+NbBytesToCopy;
-
-			OpenFiles[FILENR_ARR_INDEX].PosInFile+=NbBytesToCopy;
-			OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector+=NbBytesToCopy;
+			fat32_free_chain(FirstCluster, false);
+#if FAT_MIRROR
+			fat32_mirror_sync(0xFFFFFFFF);
+#endif
+			return INDEX_NO_MORE_SPACE;
 		}
 		
-		if(NbBytesToWrite)
+#if FAT_MIRROR
+		fat32_mirror_sync(0xFFFFFFFF);
+#endif
+	}
+	
+	uint32_t i;
+	memset(Buffer, NAME_INDEX_SLOT_EMPTY, FS32_SECTOR_SIZE);
+	for(i=0; i<FS32_NAME_INDEX_SECTORS; i++)
+		write_logical_sector(File.FirstLogicalSector+1+i, Buffer);
+	
+	//slots are written with NameIndexFirstCluster set, the header is written last
+	NameIndexFirstCluster=File.FirstLogicalSector;
+	
+	uint32_t cl=RootSector;
+	bool NoMoreEntries=false;
+	
+	while(!IS_EOC_MARKER(cl) && !NoMoreEntries)
+	{
+		read_logical_sector(cl, SecondBuffer); //Buffer is needed for the index
+		
+		uint8_t Index;
+		for(Index=0; Index<DIR_ENTRIES_PER_SECTOR; Index++)
 		{
-			bool NeedMoreSpace=false;
+			fat32_directory_entry_t * Entry=&((fat32_directory_entry_t*)SecondBuffer)[Index];
 			
-#if !FS32_NO_MODIFY			
-			if(OpenFiles[FILENR_ARR_INDEX].OpenendForModify)
+			if((uint8_t)Entry->DIR_Name[0]==DIR_ENTRY_FREE_NO_MORE_DIR)
 			{
-				uint32_t nextSector=fat32_get_next_sector(OpenFiles[FILENR_ARR_INDEX].LogicalSector);
-				if(IS_EOC_MARKER(nextSector))
-					NeedMoreSpace=true;
-				else
-				{
-					OpenFiles[FILENR_ARR_INDEX].LogicalSector=nextSector;
-					OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=0;
-				}
+				NoMoreEntries=true;
+				break;
 			}
-#endif
 			
-			if(OpenFiles[FILENR_ARR_INDEX].OpenendForAppending || OpenFiles[FILENR_ARR_INDEX].isNewFile || NeedMoreSpace)
-			{
-				pos_fat32_entry_t p_curr=get_pos_fat_entry(OpenFiles[FILENR_ARR_INDEX].LogicalSector);
-				pos_fat32_entry_t p_new=fat32_get_next_free_entry();
-				if(p_new.noFreeSpace)
-					return WRITE_NO_MORE_SPACE;
-				fat32_write_entry(&p_curr, p_new.LogicalSector);
-				fat32_write_entry(&p_new, EndOfClusterChainMarker);
-				OpenFiles[FILENR_ARR_INDEX].LogicalSector=p_new.LogicalSector;
-				OpenFiles[FILENR_ARR_INDEX].PosInLogicalSector=0;
-			}
+			if((uint8_t)Entry->DIR_Name[0]==DIR_ENTRY_FREE || (Entry->DIR_Attr&ATTR_VOLUME_ID)) //also long names
+				continue;
+			
+			name_index_insert(Entry->DIR_Name, cl, Index);
 		}
+		
+		if(!NoMoreEntries)
+			cl=fat32_get_next_sector(cl);
 	}
 	
+	memset(Buffer, 0, FS32_SECTOR_SIZE);
+	fs32_name_index_header_t * Header=(fs32_name_index_header_t*)Buffer;
+	Header->Magic=NAME_INDEX_MAGIC;
+	Header->VolumeID=VolumeID;
+	Header->NbTableSectors=FS32_NAME_INDEX_SECTORS;
+	Header->SectorDirEntry=File.SectorDirEntry;
+	Header->IndexDirEntry=File.IndexDirEntry;
+	write_logical_sector(File.FirstLogicalSector, Buffer);
+	
+	SD_READ_SECTOR(1, Buffer);
+	fat32_fsinfo_t *fsinfo=(fat32_fsinfo_t*)Buffer;
+	fsinfo->FS32_NameIndexSig=NAME_INDEX_FSINFO_SIG;
+	fsinfo->FS32_NameIndexFirstCluster=File.FirstLogicalSector;
+	SD_WRITE_SECTOR(1, Buffer);
+	
 	return STATUS_OK;
 }
 #endif
 
-#if !FS32_NO_SEEK_TELL
-FS32_status_t f_seek(const uint8_t filenr, const uint32_t pos)
+#if FS32_SUBDIR_SUPPORT
+static void set_dot_entry(fat32_directory_entry_t * const entry, char const * const name, const uint32_t cluster)
 {
-	
-#if SINGLE_FILE_CONFIG
-	(void)filenr;
-#endif
-
-	if(!OpenFiles[FILENR_ARR_INDEX].OpenedForReading && !OpenFiles[FILENR_ARR_INDEX].OpenendForModify)
-		return SEEK_CANT_SEEK_IN_THIS_MODE;
-	
-	if(pos>=OpenFiles[FILENR_ARR_INDEX].FileSize && pos!=FS_SEEK_END)
-		return SEEK_INVALID_POS;
-		
-	set_file_pos(FILENR_FIRST_FUNC_ARG pos);
-	
-	return STATUS_OK;
+	memset(entry, 0, sizeof(fat32_directory_entry_t));
+	memset(entry, ' ', 8+3); //DIR_Name and DIR_Ext
+	memcpy(entry->DIR_Name, name, strlen(name));
+	entry->DIR_Attr=ATTR_DIRECTORY;
+	entry->DIR_WrtTime=rtc_get_encoded_time();
+	entry->DIR_WrtDate=rtc_get_encoded_date();
+	entry->DIR_FstClusHI=cluster>>16;
+	entry->DIR_FstClusLO=cluster&0xFFFF;
 }
 
-uint32_t f_tell(const uint8_t filenr)
+FS32_status_t f_mkdir(char const * const path)
 {
+	file_t Dir;
+	search_result_t Result=fat32_search_for_file(path, &Dir);
 	
-#if SINGLE_FILE_CONFIG
-	(void)filenr;
+	if(Result==SEARCH_NO_PATH)
+		return MKDIR_PATH_NOT_FOUND;
+	
+	if(Result!=SEARCH_NOT_FOUND)
+		return MKDIR_ALREADY_EXISTS;
+	
+	pos_fat32_entry_t FATEntry=fat32_get_next_free_entry();
+	if(FATEntry.noFreeSpace)
+		return MKDIR_NO_MORE_SPACE;
+	
+	fat32_write_entry(&FATEntry, EndOfClusterChainMarker);
+	
+	//content first, a power loss before the entry in the parent directory is written only leaves a lost cluster behind
+	memset(Buffer, DIR_ENTRY_FREE_NO_MORE_DIR, FS32_SECTOR_SIZE);
+	set_dot_entry(&((fat32_directory_entry_t*)Buffer)[0], ".", FATEntry.LogicalSector);
+	set_dot_entry(&((fat32_directory_entry_t*)Buffer)[1], "..", (Dir.DirCluster==RootSector)?0:Dir.DirCluster); //0 means root
+	write_dir_sector(FATEntry.LogicalSector, Buffer);
+	
+	Dir.FirstLogicalSector=FATEntry.LogicalSector;
+	Dir.FileSize=0;
+	
+	if(create_dir_entry(&Dir, ATTR_DIRECTORY))
+	{
+		fat32_free_chain(FATEntry.LogicalSector, false);
+#if FAT_MIRROR
+		fat32_mirror_sync(0xFFFFFFFF);
 #endif
-
-	return OpenFiles[FILENR_ARR_INDEX].PosInFile;
+		return MKDIR_NO_MORE_SPACE;
+	}
+	
+#if FAT_MIRROR
+	fat32_mirror_sync(0xFFFFFFFF);
+#endif
+	
+	return STATUS_OK;
 }
 #endif
 
@@ -738,9 +3224,9 @@ uint32_t get_file_size(const uint8_t filenr)
 }
 
 #if !FS32_NO_FILE_LISTING
-FS32_status_t f_ls(const f_ls_callback callback)
+static FS32_status_t ls_dir(const uint32_t dir_cluster, const f_ls_callback callback)
 {
-	uint32_t cl=RootSector;
+	uint32_t cl=dir_cluster;
 	
 	while(!IS_EOC_MARKER(cl))
 	{
@@ -751,7 +3237,7 @@ FS32_status_t f_ls(const f_ls_callback callback)
 		
 		read_logical_sector(cl, Buffer);
 		
-		for(NbEntry=0; NbEntry<512/sizeof(fat32_directory_entry_t); NbEntry++)
+		for(NbEntry=0; NbEntry<DIR_ENTRIES_PER_SECTOR; NbEntry++)
 		{
 			memcpy(&DirEntry, &(((fat32_directory_entry_t*)Buffer)[NbEntry]), sizeof(fat32_directory_entry_t));
 			
@@ -764,12 +3250,23 @@ FS32_status_t f_ls(const f_ls_callback callback)
 				break;
 			}
 			
-			if(DirEntry.DIR_Attr&ATTR_LONG_NAME) //UNSUPPORTED!
+			if((DirEntry.DIR_Attr&ATTR_LONG_NAME_MASK)==ATTR_LONG_NAME) //UNSUPPORTED!
 				return LS_LONG_NAME;
 			
-			char Filename[8+1+3+1];
+			if(DirEntry.DIR_Attr&ATTR_VOLUME_ID) //volume label, skipped like fat32_search_in_dir() does
+				continue;
+			
+			char Filename[8+1+3+1+1];
 			fat32_filename_to_string(&DirEntry, Filename);
 			
+#if FS32_SUBDIR_SUPPORT
+			if(DirEntry.DIR_Name[0]=='.') //"." and ".." of a sub-directory
+				continue;
+			
+			if(DirEntry.DIR_Attr&ATTR_DIRECTORY)
+				strcat(Filename, "/");
+#endif
+			
 			callback(Filename);
 		}
 		
@@ -783,4 +3280,29 @@ FS32_status_t f_ls(const f_ls_callback callback)
 	
 	return STATUS_OK;
 }
+
+FS32_status_t f_ls(const f_ls_callback callback)
+{
+	return ls_dir(RootSector, callback);
+}
+
+#if FS32_SUBDIR_SUPPORT
+FS32_status_t f_ls_dir(char const * const path, const f_ls_callback callback)
+{
+	uint32_t Cluster=RootSector;
+	
+	if(path[0] && strcmp(path, "/"))
+	{
+		file_t Dir;
+		if(fat32_search_for_file(path, &Dir)!=SEARCH_FOUND_DIR)
+			return LS_PATH_NOT_FOUND;
+		
+		Cluster=Dir.FirstLogicalSector;
+		if(Cluster<2) //".." of a sub-directory of root
+			Cluster=RootSector;
+	}
+	
+	return ls_dir(Cluster, callback);
+}
+#endif
 #endif
@@ -15,8 +15,13 @@ AGPLv3+ and NO WARRANTY!
 
 #include <stdint.h>
 
+#include "FS32_config.h"
+
 #define FS_SEEK_END 0xFFFFFFFF
 
+//FS32_REALTIME_WRITE only: maximum number of sector read/write done by a single call of f_write() for nb_bytes (size*n) bytes
+#define FS32_RT_WRITE_MAX_IO(nb_bytes) (7*((nb_bytes)/FS32_SECTOR_SIZE)+9)
+
 typedef enum
 {
 	STATUS_OK=0,
@@ -40,12 +45,15 @@ typedef enum
 	OPEN_NO_MORE_SPACE,
 	OPEN_APPEND_SEEK_ERR,
 	OPEN_INVALID_MODE,
+	OPEN_PATH_NOT_FOUND,
+	OPEN_IS_DIRECTORY,
 	
 	READ_FAILED,
 	
 	WRITE_NO_OPEN_FILE,
 	WRITE_FILE_READ_ONLY,
 	WRITE_NO_MORE_SPACE,
+	WRITE_RT_NO_CACHED_CLUSTER,
 	
 	CLOSE_NO_OPEN_FILE,
 	CLOSE_CREATE_DIR_ENTRY_FAILED,
@@ -54,6 +62,42 @@ typedef enum
 	SEEK_INVALID_POS,
 	
 	LS_LONG_NAME,
+	LS_PATH_NOT_FOUND,
+	
+	UNLINK_FILE_NOT_FOUND,
+	UNLINK_FILE_IS_OPEN,
+	UNLINK_IS_DIRECTORY,
+	
+	TRUNCATE_NO_OPEN_FILE,
+	TRUNCATE_FILE_READ_ONLY,
+	TRUNCATE_INVALID_SIZE,
+	
+	DEFRAG_FILE_NOT_FOUND,
+	DEFRAG_FILE_IS_OPEN,
+	DEFRAG_NO_CONTIGUOUS_SPACE,
+	DEFRAG_IS_DIRECTORY,
+	
+	CONCAT_SAME_FILE,
+	CONCAT_FILE_NOT_FOUND,
+	CONCAT_FILE_IS_OPEN,
+	CONCAT_FILE_TOO_BIG,
+	CONCAT_NO_MORE_SPACE,
+	
+	COMPACT_FILES_OPEN,
+	
+	INDEX_NO_CONTIGUOUS_SPACE,
+	INDEX_NO_MORE_SPACE,
+	
+	MKDIR_ALREADY_EXISTS,
+	MKDIR_PATH_NOT_FOUND,
+	MKDIR_NO_MORE_SPACE,
+	
+	UNMOUNT_FILES_OPEN,
+	UNMOUNT_NO_SNAPSHOT_SECTOR,
+	
+	RECORD_NO_OPEN_FILE,
+	RECORD_INVALID_SIZE,
+	RECORD_INVALID_INDEX,
 	
 } FS32_status_t;
 
@@ -65,10 +109,25 @@ FS32_status_t f_open(uint8_t * const filenr, char const * const filename, const
 FS32_status_t f_close(const uint8_t filenr);
 FS32_status_t f_read(const uint8_t filenr, void * ptr, const uint16_t size, const uint16_t n);
 FS32_status_t f_write(const uint8_t filenr, void const * ptr, const uint16_t size, const uint16_t n);
+FS32_status_t f_printf(const uint8_t filenr, char const * format, ...);
 FS32_status_t f_seek(const uint8_t filenr, const uint32_t pos);
 uint32_t f_tell(const uint8_t filenr);
+FS32_status_t f_open_records(uint8_t * const filenr, char const * const filename, const uint16_t record_size);
+FS32_status_t f_read_record(const uint8_t filenr, const uint32_t index, void * ptr);
+FS32_status_t f_write_record(const uint8_t filenr, const uint32_t index, void const * ptr);
+FS32_status_t f_unlink(char const * const filename);
+FS32_status_t f_truncate(const uint8_t filenr, const uint32_t size);
+FS32_status_t f_defrag(char const * const filename, uint32_t * const fragments_before, uint32_t * const fragments_after);
+FS32_status_t f_concat(char const * const dst, char const * const src);
+FS32_status_t f_compact_root(void);
+FS32_status_t f_index_rebuild(void);
+uint16_t f_idle_step(const uint16_t budget_sectors);
+void f_sync(void);
+FS32_status_t f_unmount(void);
 uint32_t get_free_sectors_count(void);
 uint32_t get_file_size(const uint8_t filenr);
 FS32_status_t f_ls(const f_ls_callback callback);
+FS32_status_t f_ls_dir(char const * const path, const f_ls_callback callback);
+FS32_status_t f_mkdir(char const * const path);
 
 #endif
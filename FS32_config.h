@@ -4,7 +4,9 @@
 /*
 Configuration file for kittenFS32
 
-FS32_NB_FILES_MAX defines the maximum possible number of *simultaneously* opened files
+FS32_SECTOR_SIZE defines the size of a sector of your card/device in bytes, it must be the same as BPB_BytsPerSec of the FAT32 volume: 512 (SD-cards), 1024, 2048 or 4096 (4K-native eMMC, disk images formatted with "mkfs.fat -S 4096"). The buffers (and every sector of FS32_WRITEBACK_SECTORS) are this big, a cluster is still a single sector.
+
+FS32_NB_FILES_MAX defines the maximum possible number of *simultaneously* opened files, maximum 255 (40 bytes of RAM each, plus 1 byte each for a hash table if more than 8)
 Set this to 1 if you don't need to access multiple files at the same time to save FLASH and RAM.
 
 FS32_NO_READ == 1 removes f_open('r') (open existing file for reading) and f_read()
@@ -21,12 +23,63 @@ FS32_NO_SEEK_TELL == 1 removes f_seek() and f_tell()
 
 FS32_NO_FILE_LISTING == 1 removes f_ls()
 
+FS32_NO_UNLINK == 1 removes f_unlink() (delete a file)
+
+FS32_NO_TRUNCATE == 1 removes f_truncate() (make an open file smaller)
+
+FS32_PRINTF_SUPPORT == 1 adds f_printf() that formats text directly into the sector buffer of the file, without a buffer of your own and without printf() from the standard library. Needs f_write().
+
+FS32_RECORD_SUPPORT == 1 adds f_open_records(), f_read_record() and f_write_record() for files made of records of a fixed size. The clusters of such a file are remembered as a table of extents (runs of contiguous clusters) when it is opened, so reading or writing a record does not follow the cluster chain like f_seek(). Needs FS32_NO_MODIFY to be 0.
+FS32_RECORD_EXTENTS defines how many extents are remembered for each open file, maximum 255 (8 bytes of RAM each, plus 8 bytes, for every possible open file). Records behind the last extent of a file with more fragments are found by following the chain, use f_defrag() to make it a single extent.
+
+FS32_SUBDIR_SUPPORT == 1 allows paths with sub-directories separated by '/' (like "LOGS/DAY1/TEMP.CSV") for all functions taking a filename and adds f_mkdir() and f_ls_dir(). f_compact_root() and the name index only work on the root directory.
+FS32_DIR_CACHE_SIZE defines how many resolved sub-directories are remembered so opening files in the same directory again does not search the parent directories, maximum 255 (19 bytes of RAM each)
+
 FS32_PARTITION_SUPPORT == 1 adds support for partitions (type MBR primary only)
 
+FS32_TWO_FAT_SUPPORT == 1 allows volumes with two FATs (the default of most formatting tools). Only the first FAT is updated while writing, the changed parts are copied to the second FAT by f_close(), f_sync() and f_idle_step() and at the end of the functions changing the FAT without an open file (f_unlink(), f_truncate(), f_defrag(), ...).
+FS32_FAT_MIRROR_BITMAP_BYTES defines the size of the bitmap remembering the changed parts of the FAT, each bit covers 1/(8*FS32_FAT_MIRROR_BITMAP_BYTES) of the FAT. More bytes means less sectors to copy for scattered changes, maximum 8192 (1 byte of RAM each)
+
+FS32_RECOUNT_FREE_ON_INIT defines what f_init() does with the free cluster count stored in FSINFO:
+	0: trust it
+	1: recount by scanning the whole FAT if the stored value is obviously invalid (unknown/0xFFFFFFFF or bigger than the card)
+	2: always recount by scanning the whole FAT (slow on big cards but the value is always accurate)
+
+FS32_SNAPSHOT_SUPPORT == 1 adds f_unmount() which writes a summary of the allocation state (free cluster count and free clusters per part of the FAT) into a free reserved sector. f_init() loads it in two sector reads after a clean f_unmount() and only scans the whole FAT after an unclean shutdown (or if a PC changed the card in between), whatever FS32_RECOUNT_FREE_ON_INIT says unless it is 2. The free clusters per part of the FAT also let the search for a free cluster skip full parts. Needs 2 bytes of RAM for each part.
+FS32_SNAPSHOT_GROUPS defines in how many parts the FAT is divided for the snapshot, maximum 240
+
+FS32_DEFRAG_SUPPORT == 1 adds f_defrag() for moving a fragmented file into contiguous clusters
+
+FS32_CONCAT_SUPPORT == 1 adds f_concat() for appending a file to another one. If the size of the first file is a multiple of the sector size this only links the cluster chains, otherwise the second file is copied. Needs an additional sector buffer (FS32_SECTOR_SIZE bytes of RAM).
+
+FS32_COMPACT_ROOT_SUPPORT == 1 adds f_compact_root() for removing deleted entries from the root directory and freeing the clusters no longer needed by it. Shares the additional sector buffer with f_concat().
+
+FS32_NAME_INDEX_SUPPORT == 1 keeps a hash table of the names in the root directory in the hidden file FS32IDX.SYS, so f_open() of an existing file needs only a few sector reads instead of scanning the whole directory. Create it once with f_index_rebuild(), it is found again by f_init() and updated when files are created or deleted.
+FS32_NAME_INDEX_SECTORS defines the size of the hash table in sectors (32 names each), use at least twice the number of files you expect. Changing it needs f_index_rebuild().
+
+FS32_IDLE_STEP_SUPPORT == 1 adds f_idle_step() for doing FAT maintenance (searching free clusters, verifying the free cluster count) in the background
+FS32_FREE_CLUSTER_CACHE_SIZE defines how many free clusters f_idle_step() searches in advance, maximum 255 (4 bytes of RAM each)
+
+FS32_REALTIME_WRITE == 1 guarantees a maximum number of sector IO for each call of f_write() (see FS32_RT_WRITE_MAX_IO() in FS32.h). f_write() only uses free clusters found in advance by f_idle_step() and FSINFO is only updated by f_close() and f_idle_step(). Needs FS32_IDLE_STEP_SUPPORT.
+
+FS32_ALLOCATION_UNIT_SECTORS != 0 makes every new file begin on the first sector of an entirely free allocation unit (AU) of the card if there is one, and a file being extended continues to fill its AU even if other files are written at the same time. When its AU is full the file continues at the beginning of the next entirely free AU (looking for it reads one FAT sector per AU, the search continues after the AU found last time and is not repeated while no AU is free and no clusters were freed). SD-cards write faster this way. The value is the size of an AU in sectors (8192 for the usual 4MiB, see the AU_SIZE field of the SD-status of your card). Not used by f_write() in FS32_REALTIME_WRITE-mode.
+
+FS32_DISCARD_SUPPORT == 1 makes f_unlink() and f_truncate() tell the card which sectors are no longer used. You need to provide sd_discard_sectors() in this case.
+
+FS32_MULTI_BLOCK_READ == 1 makes the FAT scan of FS32_RECOUNT_FREE_ON_INIT use multi block reads (CMD18). You need to provide sd_read_multiple_sectors_start/next/stop() in this case.
+
+FS32_WRITEBACK_SECTORS != 0 keeps that many written sectors in RAM (FS32_SECTOR_SIZE bytes each, maximum 255) instead of writing them to the card immediately. Writing the same sector again only updates the copy in RAM. The queue is written to the card when it is full, by f_close() and by f_sync(), sorted by sector number with data before FAT before directories so a power loss while writing can't leave a directory entry pointing to clusters that are not allocated. Everything in the queue is lost if power is removed before f_close() or f_sync(). Can't be used with FS32_REALTIME_WRITE.
+
+FS32_MULTI_BLOCK_WRITE == 1 writes consecutive sectors of the write-back queue with multi block writes (CMD25). You need to provide sd_write_multiple_sectors_start/next/stop() in this case. Needs FS32_WRITEBACK_SECTORS.
+
 If MODIFY is enabled FS32_NO_WRITE must be 0 (WRITE enabled).
 
 If APPEND and/or MODIFY is enabled FS32_NO_SEEK_TELL must be 0 (SEEK_TELL enabled).
 
+If UNLINK and/or TRUNCATE is enabled FS32_NO_WRITE must be 0 (WRITE enabled). TRUNCATE also needs FS32_NO_SEEK_TELL to be 0.
+
+DEFRAG, CONCAT, COMPACT_ROOT, NAME_INDEX and SUBDIR need FS32_NO_WRITE to be 0.
+
 (c) 2021-2022 by kittennbfive
 
 version 0.06 - 17.04.22
@@ -34,6 +87,8 @@ version 0.06 - 17.04.22
 AGPLv3+ and NO WARRANTY!
 */
 
+#define FS32_SECTOR_SIZE 512
+
 #define FS32_NB_FILES_MAX 2
 
 #define FS32_NO_READ 0
@@ -48,7 +103,74 @@ AGPLv3+ and NO WARRANTY!
 
 #define FS32_NO_FILE_LISTING 0
 
+#define FS32_NO_UNLINK 0
+
+#define FS32_NO_TRUNCATE 0
+
+//disabled by default
+#define FS32_PRINTF_SUPPORT 0
+
+//disabled by default
+#define FS32_RECORD_SUPPORT 0
+
+#define FS32_RECORD_EXTENTS 8
+
+//disabled by default
+#define FS32_SUBDIR_SUPPORT 0
+
+#define FS32_DIR_CACHE_SIZE 8
+
 //disabled by default
 #define FS32_PARTITION_SUPPORT 0
 
+//disabled by default
+#define FS32_TWO_FAT_SUPPORT 0
+
+#define FS32_FAT_MIRROR_BITMAP_BYTES 32
+
+//disabled by default
+#define FS32_RECOUNT_FREE_ON_INIT 0
+
+//disabled by default
+#define FS32_SNAPSHOT_SUPPORT 0
+
+#define FS32_SNAPSHOT_GROUPS 64
+
+//disabled by default
+#define FS32_DEFRAG_SUPPORT 0
+
+//disabled by default
+#define FS32_CONCAT_SUPPORT 0
+
+//disabled by default
+#define FS32_COMPACT_ROOT_SUPPORT 0
+
+//disabled by default
+#define FS32_NAME_INDEX_SUPPORT 0
+
+#define FS32_NAME_INDEX_SECTORS 16
+
+//disabled by default
+#define FS32_IDLE_STEP_SUPPORT 0
+
+#define FS32_FREE_CLUSTER_CACHE_SIZE 16
+
+//disabled by default
+#define FS32_REALTIME_WRITE 0
+
+//disabled by default
+#define FS32_ALLOCATION_UNIT_SECTORS 0
+
+//disabled by default
+#define FS32_DISCARD_SUPPORT 0
+
+//disabled by default
+#define FS32_MULTI_BLOCK_READ 0
+
+//disabled by default
+#define FS32_WRITEBACK_SECTORS 0
+
+//disabled by default
+#define FS32_MULTI_BLOCK_WRITE 0
+
 #endif
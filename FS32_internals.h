@@ -16,6 +16,22 @@ AGPLv3+ and NO WARRANTY!
 version 0.06 - 17.04.22
 */
 
+//Sector size: constant shifts and masks instead of divisions
+
+#if FS32_SECTOR_SIZE==512
+#define SECTOR_SHIFT 9
+#elif FS32_SECTOR_SIZE==1024
+#define SECTOR_SHIFT 10
+#elif FS32_SECTOR_SIZE==2048
+#define SECTOR_SHIFT 11
+#elif FS32_SECTOR_SIZE==4096
+#define SECTOR_SHIFT 12
+#else
+#error FS32_SECTOR_SIZE must be 512, 1024, 2048 or 4096.
+#endif
+
+#define SECTOR_MASK (FS32_SECTOR_SIZE-1)
+
 //Master Boot Record and Partition Table
 
 typedef struct __attribute__((__packed__))
@@ -73,7 +89,9 @@ typedef struct __attribute__((__packed__))
 typedef struct __attribute__((__packed__))
 {
 	uint32_t FSI_LeadSig;
-	uint8_t FSI_Reserved1[480];
+	uint32_t FS32_NameIndexSig; //kittenFS32 only, reserved (zero) in specs
+	uint32_t FS32_NameIndexFirstCluster; //kittenFS32 only, reserved (zero) in specs
+	uint8_t FSI_Reserved1[472];
 	uint32_t FSI_StrucSig;
 	uint32_t FSI_Free_Count;
 // NO!	uint32_t FSI_Nxt_Free; //cluster number at which there are free clusters, invalid/unknown if 0xFFFFFFFF
@@ -88,6 +106,16 @@ typedef struct __attribute__((__packed__))
 
 typedef uint32_t fat32_entry_t;
 
+#define FAT_ENTRIES_PER_SECTOR (FS32_SECTOR_SIZE/sizeof(fat32_entry_t))
+#define FAT_ENTRIES_SHIFT (SECTOR_SHIFT-2)
+
+//index of an entry inside a FAT sector, 8 bits are enough for the 128 entries of a 512 bytes sector
+#if FS32_SECTOR_SIZE==512
+typedef uint8_t fat_entry_index_t;
+#else
+typedef uint16_t fat_entry_index_t;
+#endif
+
 typedef struct __attribute__((__packed__))
 {
 	//single parameter DIR_Name[11] in specs, separated here
@@ -104,6 +132,8 @@ typedef struct __attribute__((__packed__))
 	uint32_t DIR_FileSize;
 } fat32_directory_entry_t;
 
+#define DIR_ENTRIES_PER_SECTOR (FS32_SECTOR_SIZE/sizeof(fat32_directory_entry_t))
+
 #define ATTR_READ_ONLY 0x01
 #define ATTR_HIDDEN 0x02
 #define ATTR_SYSTEM 0x04
@@ -111,6 +141,55 @@ typedef struct __attribute__((__packed__))
 #define ATTR_DIRECTORY 0x10
 #define ATTR_ARCHIVE 0x20
 #define ATTR_LONG_NAME (ATTR_READ_ONLY|ATTR_HIDDEN|ATTR_SYSTEM|ATTR_VOLUME_ID)
+#define ATTR_LONG_NAME_MASK (ATTR_LONG_NAME|ATTR_DIRECTORY|ATTR_ARCHIVE)
+
+//Name index (FS32IDX.SYS): header in the first cluster followed by FS32_NAME_INDEX_SECTORS of hash table, contiguous
+
+#define NAME_INDEX_FILENAME "FS32IDX.SYS"
+#define NAME_INDEX_RAW_NAME "FS32IDX SYS"
+#define NAME_INDEX_FSINFO_SIG 0x58444946 //"FIDX"
+#define NAME_INDEX_MAGIC 0x31584449 //"IDX1"
+
+typedef struct __attribute__((__packed__))
+{
+	uint32_t Magic;
+	uint32_t VolumeID; //BS_VolID of the card
+	uint32_t NbTableSectors;
+	uint32_t SectorDirEntry; //directory entry of FS32IDX.SYS itself
+	uint8_t IndexDirEntry;
+} fs32_name_index_header_t;
+
+typedef struct __attribute__((__packed__))
+{
+	char Name[8+3]; //as in the directory entry
+	uint8_t IndexDirEntry;
+	uint32_t SectorDirEntry;
+} fs32_name_index_slot_t;
+
+#define NAME_INDEX_SLOTS_PER_SECTOR (FS32_SECTOR_SIZE/sizeof(fs32_name_index_slot_t))
+#define NAME_INDEX_SLOT_EMPTY 0x00
+#define NAME_INDEX_SLOT_DELETED 0xE5
+#define NAME_INDEX_NO_SLOT 0xFFFFFFFF
+
+//Allocation snapshot: written by f_unmount() into the reserved sector BPB_BkBootSec+3 (right after the backup of the 3 boot sectors)
+
+#define SNAPSHOT_MAGIC 0x50414E53 //"SNAP"
+#define SNAPSHOT_STATE_CLEAN 0x4E41454C //"LEAN", written by f_unmount()
+#define SNAPSHOT_STATE_DIRTY 0 //written by f_init() before anything is changed
+#define SNAPSHOT_GROUP_MANY 0xFFFF //at least this many free clusters in the group (or unknown)
+
+typedef struct __attribute__((__packed__))
+{
+	uint32_t Magic;
+	uint32_t VolumeID; //BS_VolID of the card
+	uint32_t State;
+	uint32_t NbFreeSectors; //same as FSI_Free_Count, otherwise the card was changed after f_unmount()
+	uint32_t LastAllocatedSector; //same as FSI_Last_Allocated
+	uint32_t GroupSectors; //FAT sectors per group
+	uint16_t GroupFree[FS32_SNAPSHOT_GROUPS]; //free clusters in each group of FAT sectors, saturated at SNAPSHOT_GROUP_MANY
+	uint8_t Unused[FS32_SECTOR_SIZE-6*4-2*FS32_SNAPSHOT_GROUPS-4];
+	uint32_t Checksum; //of everything before
+} fs32_snapshot_t;
 
 #define DIR_ENTRY_FREE 0xE5
 #define DIR_ENTRY_FREE_NO_MORE_DIR 0x00
@@ -122,32 +201,81 @@ typedef struct
 	bool noFreeSpace;
 	uint32_t LogicalSector;
 	uint32_t FAT_SectorNumber;
-	uint8_t FAT_EntryIndex;
+	fat_entry_index_t FAT_EntryIndex;
 } pos_fat32_entry_t;
 
+typedef enum
+{
+	FILE_CLOSED=0,
+	FILE_READ, //read existing file, seeking allowed
+	FILE_NEW, //create new file and write to it, seeking not allowed
+	FILE_APPEND, //append to end of existing file, seeking not allowed
+	FILE_MODIFY //read or write existing file, seeking allowed
+} file_mode_t;
+
 typedef struct
-{	
-	bool FileFound;
-	bool isInUse;
-	bool isNewFile; //create new file and write to it, seeking not allowed
-	bool OpenendForModify; //read or write existing file, seeking allowed
-	bool OpenendForAppending; //append to end of existing file, seeking not allowed
-	bool OpenedForReading; //read existing file, seeking allowed
-	
-	char Name[8+1+3+1];
-	
+{
 	uint32_t FirstLogicalSector;
 	
 	uint32_t LogicalSector;
-	uint32_t PosInLogicalSector;
 	
 	uint32_t PosInFile;
 	uint32_t FileSize;
 	
 	uint32_t SectorDirEntry;
-	uint32_t IndexDirEntry;
+	uint32_t DirCluster; //first cluster of the directory containing the file
+	
+	uint16_t PosInLogicalSector; //0 to FS32_SECTOR_SIZE
+	uint8_t IndexDirEntry;
+	
+	uint8_t Mode; //file_mode_t
+	
+	char RawName[8+3]; //as in the directory entry
+	
+	uint8_t Next; //next free slot or next opened file in the same bucket of the hash table
 } file_t;
 
+#define FILE_NO_SLOT 0xFF
+
+#define PRINTF_MAX_DIGITS 24 //for f_printf(), 20 digits of a 64 bits long, the decimal point and up to 22 decimals of fixed point numbers
+
+typedef struct
+{
+	uint32_t FileSector; //index of the first sector of the extent inside the file
+	uint32_t Cluster; //first cluster of the extent
+} record_extent_t;
+
+typedef struct
+{
+	uint16_t RecordSize; //0 if the file was not opened by f_open_records()
+	uint8_t NbExtents;
+	uint32_t NbSectorsMapped; //sectors of the file covered by Extents, if the table is full the chain can continue after the last one
+	record_extent_t Extents[FS32_RECORD_EXTENTS];
+} record_map_t;
+
+typedef enum
+{
+	SEARCH_NOT_FOUND=0,
+	SEARCH_FOUND_FILE,
+	SEARCH_FOUND_DIR,
+	SEARCH_NO_PATH //a directory of the path does not exist
+} search_result_t;
+
+typedef struct
+{
+	uint32_t Parent; //first cluster of the parent directory
+	uint32_t Cluster; //first cluster of the directory
+	char RawName[8+3];
+} dir_cache_entry_t;
+
+typedef struct
+{
+	uint32_t Sector;
+	uint8_t Class; //writeback_class_t
+} writeback_entry_t;
+
+#define OPEN_FILES_HASHED (FS32_NB_FILES_MAX>8) //checking if a file is already open by comparing all slots is faster for a few files
+
 //Some sanity checks on the configuration options and some internal defines depending on those options
 
 #if FS32_NO_READ && FS32_NO_WRITE && FS32_NO_APPEND
@@ -158,6 +286,10 @@ typedef struct
 #error You need at least one open file, dont you?
 #endif
 
+#if FS32_NB_FILES_MAX>255
+#error FS32_NB_FILES_MAX must not be bigger than 255.
+#endif
+
 #if FS32_NO_WRITE && !FS32_NO_MODIFY
 #error To modify files you need write-functionality enabled. 
 #endif
@@ -166,6 +298,54 @@ typedef struct
 #error To modify files or append to files you need f_seek enabled.
 #endif
 
+#if FS32_NO_WRITE && (!FS32_NO_UNLINK || !FS32_NO_TRUNCATE)
+#error To delete files or make them smaller you need write-functionality enabled.
+#endif
+
+#if FS32_NO_WRITE && FS32_DEFRAG_SUPPORT
+#error To defragment files you need write-functionality enabled.
+#endif
+
+#if FS32_NO_WRITE && FS32_CONCAT_SUPPORT
+#error To concatenate files you need write-functionality enabled.
+#endif
+
+#if FS32_NO_WRITE && FS32_COMPACT_ROOT_SUPPORT
+#error To compact the root directory you need write-functionality enabled.
+#endif
+
+#if FS32_NO_WRITE && FS32_NAME_INDEX_SUPPORT
+#error The name index is updated when files are created, you need write-functionality enabled.
+#endif
+
+#if FS32_NAME_INDEX_SUPPORT && !FS32_NAME_INDEX_SECTORS
+#error FS32_NAME_INDEX_SECTORS must not be 0.
+#endif
+
+#if FS32_NO_WRITE && FS32_SUBDIR_SUPPORT
+#error Sub-directories need write-functionality enabled for f_mkdir().
+#endif
+
+#if FS32_SUBDIR_SUPPORT && (!FS32_DIR_CACHE_SIZE || FS32_DIR_CACHE_SIZE>255)
+#error FS32_DIR_CACHE_SIZE must be between 1 and 255.
+#endif
+
+#if FS32_PRINTF_SUPPORT && FS32_NO_WRITE && FS32_NO_APPEND && FS32_NO_MODIFY
+#error f_printf() writes to a file, you need write-, append- or modify-functionality enabled.
+#endif
+
+#if FS32_RECORD_SUPPORT && FS32_NO_MODIFY
+#error Records are read and written in place, you need modify-functionality enabled.
+#endif
+
+#if FS32_RECORD_SUPPORT && (!FS32_RECORD_EXTENTS || FS32_RECORD_EXTENTS>255)
+#error FS32_RECORD_EXTENTS must be between 1 and 255.
+#endif
+
+#if !FS32_NO_TRUNCATE && FS32_NO_SEEK_TELL
+#error To make files smaller you need f_seek enabled.
+#endif
+
 #if FS32_NB_FILES_MAX>1
 #define FIRST_ARG_FILENR const uint8_t filenr,
 #define ONLY_ARG_FILENR const uint8_t filenr
@@ -185,18 +365,114 @@ typedef struct
 #define FILENR_PTR_FUNC_ARG
 #endif
 
+#if FS32_IDLE_STEP_SUPPORT && FS32_NO_WRITE && FS32_NO_APPEND
+#error f_idle_step() is useless without write or append.
+#endif
+
+#if FS32_IDLE_STEP_SUPPORT && (!FS32_FREE_CLUSTER_CACHE_SIZE || FS32_FREE_CLUSTER_CACHE_SIZE>255)
+#error FS32_FREE_CLUSTER_CACHE_SIZE must be between 1 and 255.
+#endif
+
+#if FS32_REALTIME_WRITE && !FS32_IDLE_STEP_SUPPORT
+#error FS32_REALTIME_WRITE needs FS32_IDLE_STEP_SUPPORT.
+#endif
+
+#if FS32_ALLOCATION_UNIT_SECTORS && FS32_NO_WRITE
+#error The allocation unit policy is for new files, you need write-functionality enabled.
+#endif
+
+#if FS32_DISCARD_SUPPORT && FS32_NO_UNLINK && FS32_NO_TRUNCATE
+#error Clusters are only freed by f_unlink() and f_truncate(), discarding is useless without them.
+#endif
+
+#if FS32_TWO_FAT_SUPPORT && (!FS32_FAT_MIRROR_BITMAP_BYTES || FS32_FAT_MIRROR_BITMAP_BYTES>8192)
+#error FS32_FAT_MIRROR_BITMAP_BYTES must be between 1 and 8192.
+#endif
+
+#if FS32_SNAPSHOT_SUPPORT && FS32_NO_WRITE && FS32_NO_APPEND
+#error The allocation snapshot is useless without write or append.
+#endif
+
+#if FS32_SNAPSHOT_SUPPORT && (!FS32_SNAPSHOT_GROUPS || FS32_SNAPSHOT_GROUPS>240)
+#error FS32_SNAPSHOT_GROUPS must be between 1 and 240.
+#endif
+
+//the second FAT only needs to be updated if something can be written
+#define FAT_MIRROR (FS32_TWO_FAT_SUPPORT && (!FS32_NO_WRITE || !FS32_NO_APPEND))
+
+#if FS32_RECOUNT_FREE_ON_INIT>2
+#error FS32_RECOUNT_FREE_ON_INIT must be 0, 1 or 2.
+#endif
+
+#if FS32_WRITEBACK_SECTORS>255
+#error FS32_WRITEBACK_SECTORS must not be bigger than 255.
+#endif
+
+#if FS32_WRITEBACK_SECTORS && FS32_NO_WRITE && FS32_NO_APPEND
+#error FS32_WRITEBACK_SECTORS is useless without write or append.
+#endif
+
+#if FS32_WRITEBACK_SECTORS && FS32_REALTIME_WRITE
+#error FS32_REALTIME_WRITE guarantees a maximum number of sector IO for each f_write(), this is not possible with FS32_WRITEBACK_SECTORS.
+#endif
+
+#if FS32_MULTI_BLOCK_WRITE && !FS32_WRITEBACK_SECTORS
+#error Multi block writes are only used for flushing FS32_WRITEBACK_SECTORS.
+#endif
+
 #if FS32_PARTITION_SUPPORT
-#define SD_READ_SECTOR(Sector, Buffer) sd_read_sector((StartOfPartition+Sector), Buffer)
-#define SD_WRITE_SECTOR(Sector, Buffer) sd_write_sector((StartOfPartition+Sector), Buffer)
+#define SD_READ_SECTOR_NOW(Sector, Buffer) sd_read_sector((StartOfPartition+Sector), Buffer)
+#define SD_WRITE_SECTOR_NOW(Sector, Buffer) sd_write_sector((StartOfPartition+Sector), Buffer)
+#define SD_READ_MULTIPLE_SECTORS_START(Sector) sd_read_multiple_sectors_start(StartOfPartition+Sector)
+#define SD_WRITE_MULTIPLE_SECTORS_START(Sector) sd_write_multiple_sectors_start(StartOfPartition+Sector)
+#define SD_DISCARD_SECTORS_NOW(Sector, Count) sd_discard_sectors((StartOfPartition+Sector), Count)
+#else
+#define SD_READ_SECTOR_NOW(Sector, Buffer) sd_read_sector(Sector, Buffer)
+#define SD_WRITE_SECTOR_NOW(Sector, Buffer) sd_write_sector(Sector, Buffer)
+#define SD_READ_MULTIPLE_SECTORS_START(Sector) sd_read_multiple_sectors_start(Sector)
+#define SD_WRITE_MULTIPLE_SECTORS_START(Sector) sd_write_multiple_sectors_start(Sector)
+#define SD_DISCARD_SECTORS_NOW(Sector, Count) sd_discard_sectors(Sector, Count)
+#endif
+
+//with FS32_WRITEBACK_SECTORS everything goes through the write-back queue, ..._NOW() accesses the card directly
+#if FS32_WRITEBACK_SECTORS
+#define SD_READ_SECTOR(Sector, Buffer) writeback_read(Sector, Buffer)
+#define SD_WRITE_SECTOR(Sector, Buffer) writeback_write(Sector, Buffer, WB_CLASS_AUTO)
+#define SD_DISCARD_SECTORS(Sector, Count) writeback_discard(Sector, Count)
 #else
-#define SD_READ_SECTOR(Sector, Buffer) sd_read_sector(Sector, Buffer)
-#define SD_WRITE_SECTOR(Sector, Buffer) sd_write_sector(Sector, Buffer)
+#define SD_READ_SECTOR(Sector, Buffer) SD_READ_SECTOR_NOW(Sector, Buffer)
+#define SD_WRITE_SECTOR(Sector, Buffer) SD_WRITE_SECTOR_NOW(Sector, Buffer)
+#define SD_DISCARD_SECTORS(Sector, Count) SD_DISCARD_SECTORS_NOW(Sector, Count)
 #endif
 
+//write-back queue: sectors are flushed in this order (and by ascending sector number inside a class)
+typedef enum
+{
+	WB_CLASS_FREE=0, //unused entry of the queue
+	WB_CLASS_DATA, //data of files, can always be written earlier than issued
+	WB_CLASS_FAT,
+	WB_CLASS_DIR, //directory sectors
+	WB_CLASS_RESERVED, //FSINFO, only a hint, never forces a flush
+	WB_CLASS_AUTO //for writeback_write(): class from the sector number, sectors of the data area are WB_CLASS_DATA
+} writeback_class_t;
+
 //You need to provide these functions:
 void sd_read_sector(const uint32_t sector, uint8_t * const data);
 void sd_write_sector(const uint32_t sector, uint8_t const * const data);
 uint16_t rtc_get_encoded_date(void);
 uint16_t rtc_get_encoded_time(void);
 
+//Only if FS32_MULTI_BLOCK_READ is enabled:
+void sd_read_multiple_sectors_start(const uint32_t sector);
+void sd_read_multiple_sectors_next(uint8_t * const data);
+void sd_read_multiple_sectors_stop(void);
+
+//Only if FS32_MULTI_BLOCK_WRITE is enabled:
+void sd_write_multiple_sectors_start(const uint32_t sector);
+void sd_write_multiple_sectors_next(uint8_t const * const data);
+void sd_write_multiple_sectors_stop(void);
+
+//Only if FS32_DISCARD_SUPPORT is enabled:
+void sd_discard_sectors(const uint32_t sector, const uint32_t count);
+
 #endif
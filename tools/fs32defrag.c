@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "FS32.h"
+
+#include "FS32_config.h"
+
+#include "image.h"
+
+/*
+fs32defrag - defragment files on an image of a card formatted for kittenFS32
+
+Every file given on the command line (or every file of the root directory if none is given) is moved into contiguous clusters using f_defrag().
+
+Needs FS32_DEFRAG_SUPPORT set to 1 in FS32_config.h. Build from this directory with:
+gcc -Wall -Wextra -O2 -I.. ../FS32.c image.c fs32defrag.c -o fs32defrag
+
+usage: fs32defrag [-p partition] image [FILE...]
+
+(c) 2021-2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#if !FS32_DEFRAG_SUPPORT
+#error Set FS32_DEFRAG_SUPPORT to 1 in FS32_config.h to build this tool.
+#endif
+
+static char (*Files)[8+1+3+1];
+static uint32_t NbFiles;
+
+static void collect_file(char const * const file)
+{
+	if(!file || file[strlen(file)-1]=='/') //directories can't be defragmented
+		return;
+	
+	Files=realloc(Files, (NbFiles+1)*sizeof(*Files));
+	if(!Files)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	strncpy(Files[NbFiles], file, 8+1+3+1);
+	NbFiles++;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int partition=-1;
+	
+	while((opt=getopt(argc, argv, "p:"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'p': partition=atoi(optarg); break;
+			default: fprintf(stderr, "usage: %s [-p partition] image [FILE...]\n", argv[0]); return 1;
+		}
+	}
+	
+	if(optind>=argc)
+	{
+		fprintf(stderr, "usage: %s [-p partition] image [FILE...]\n", argv[0]);
+		return 1;
+	}
+	
+	if(!image_open(argv[optind], true))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	
+	FS32_status_t ret;
+	
+	if(partition>=0)
+	{
+#if FS32_PARTITION_SUPPORT
+		if((ret=f_set_partition(partition))!=STATUS_OK)
+		{
+			fprintf(stderr, "f_set_partition failed: %d\n", ret);
+			return 1;
+		}
+#else
+		fprintf(stderr, "partitions need FS32_PARTITION_SUPPORT set to 1 in FS32_config.h\n");
+		return 1;
+#endif
+	}
+	
+	if((ret=f_init())!=STATUS_OK)
+	{
+		fprintf(stderr, "f_init failed: %d\n", ret);
+		return 1;
+	}
+	
+	int i;
+	for(i=optind+1; i<argc; i++)
+		collect_file(argv[i]);
+	
+#if !FS32_NO_FILE_LISTING
+	if(optind+1>=argc && (ret=f_ls(&collect_file))!=STATUS_OK)
+	{
+		fprintf(stderr, "f_ls failed: %d\n", ret);
+		return 1;
+	}
+#endif
+	
+	uint32_t TotalBefore=0, TotalAfter=0;
+	int errors=0;
+	
+	uint32_t j;
+	for(j=0; j<NbFiles; j++)
+	{
+		uint32_t before, after;
+		
+		ret=f_defrag(Files[j], &before, &after);
+		
+		if(ret==STATUS_OK)
+		{
+			printf("%-12s %6u -> %u fragment(s)\n", Files[j], before, after);
+			TotalBefore+=before;
+			TotalAfter+=after;
+		}
+		else
+		{
+			printf("%-12s failed: %s\n", Files[j], ret==DEFRAG_NO_CONTIGUOUS_SPACE?"not enough contiguous free space":"error");
+			errors++;
+		}
+	}
+	
+	printf("total: %u -> %u fragment(s), %u free sectors\n", TotalBefore, TotalAfter, get_free_sectors_count());
+	
+	free(Files);
+	image_close();
+	
+	return errors?1:0;
+}
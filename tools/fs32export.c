@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "FS32.h"
+
+#include "FS32_config.h"
+#include "FS32_internals.h"
+
+#include "image.h"
+
+/*
+fs32export - copy all files from images of cards formatted for kittenFS32 to the host
+
+The card is checked with f_init(), then the whole FAT is read into memory with a single read and the extents (runs of contiguous clusters) of every file are computed from the directories. The files are copied by a pool of threads using big reads of whole extents, in the order of their position on the card. Sub-directories are recreated on the host. The files of each image are written to OUTDIR/<name of the image>/ and the throughput is printed for each image.
+
+The image is opened read-only, f_init() must not write to it so FS32_SNAPSHOT_SUPPORT and FS32_RECOUNT_FREE_ON_INIT need to be 0 in FS32_config.h. Build from this directory with:
+gcc -Wall -Wextra -O2 -I.. ../FS32.c image.c fs32export.c -o fs32export -lpthread
+
+usage: fs32export [-p partition] [-j threads] [-o outdir] image [image...]
+
+(c) 2021-2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#if FS32_SNAPSHOT_SUPPORT || FS32_RECOUNT_FREE_ON_INIT
+#error f_init() writes to the card with FS32_SNAPSHOT_SUPPORT or FS32_RECOUNT_FREE_ON_INIT, set both to 0 in FS32_config.h to build this tool.
+#endif
+
+#define NB_THREADS_DEFAULT 4
+#define COPY_CHUNK_BYTES (1024*1024) //maximum size of a single read from the image
+#define MAX_DIR_DEPTH 16
+
+void fat32_filename_to_string(fat32_directory_entry_t const * const entry, char * const string); //from FS32.c
+
+typedef struct
+{
+	uint32_t Cluster;
+	uint32_t NbClusters;
+} extent_t;
+
+typedef struct
+{
+	char * Path; //on the host
+	uint32_t Size;
+	uint32_t NbExtents;
+	extent_t * Extents;
+} export_file_t;
+
+static uint32_t StartOfPartition;
+static uint32_t FirstDataSector;
+static uint32_t TotalNbOfDataSectors;
+static uint32_t * FAT; //the whole FAT of the image
+
+static export_file_t * Files;
+static uint32_t NbFiles;
+
+static pthread_mutex_t NextFileLock=PTHREAD_MUTEX_INITIALIZER;
+static uint32_t NextFile; //next entry of Files to copy
+static uint64_t BytesCopied;
+static uint32_t NbErrors;
+
+static void * xrealloc(void * const ptr, const size_t size)
+{
+	void * p=realloc(ptr, size);
+	if(!p)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+static bool read_image(void * const data, const size_t size, const uint64_t sector)
+{
+	size_t Done=0;
+	
+	while(Done<size)
+	{
+		ssize_t ret=pread(image_get_fd(), (uint8_t*)data+Done, size-Done, (off_t)(sector*FS32_SECTOR_SIZE+Done));
+		if(ret<=0)
+			return false;
+		Done+=ret;
+	}
+	
+	return true;
+}
+
+static bool valid_cluster(const uint32_t cluster)
+{
+	return cluster>=2 && cluster<TotalNbOfDataSectors+2;
+}
+
+static uint32_t next_cluster(const uint32_t cluster)
+{
+	return FAT[cluster]&0x0FFFFFFF;
+}
+
+static uint64_t cluster_to_sector(const uint32_t cluster)
+{
+	return (uint64_t)StartOfPartition+FirstDataSector+(cluster-2);
+}
+
+//follow a chain in the FAT in memory, NULL if it is broken or too short for nb_clusters
+static extent_t * get_extents(uint32_t cluster, const uint32_t nb_clusters, uint32_t * const nb_extents)
+{
+	extent_t * Extents=NULL;
+	uint32_t NbExtents=0;
+	uint32_t i;
+	
+	for(i=0; i<nb_clusters; i++)
+	{
+		if(!valid_cluster(cluster))
+		{
+			free(Extents);
+			return NULL;
+		}
+		
+		if(NbExtents && Extents[NbExtents-1].Cluster+Extents[NbExtents-1].NbClusters==cluster)
+			Extents[NbExtents-1].NbClusters++;
+		else
+		{
+			if((NbExtents&(NbExtents-1))==0) //grow at powers of 2
+				Extents=xrealloc(Extents, (NbExtents?2*NbExtents:1)*sizeof(extent_t));
+			Extents[NbExtents].Cluster=cluster;
+			Extents[NbExtents].NbClusters=1;
+			NbExtents++;
+		}
+		
+		if(i+1<nb_clusters)
+			cluster=next_cluster(cluster);
+	}
+	
+	*nb_extents=NbExtents;
+	return Extents;
+}
+
+static void add_file(char const * const path, fat32_directory_entry_t const * const entry)
+{
+	uint32_t Cluster=((uint32_t)entry->DIR_FstClusHI<<16)|entry->DIR_FstClusLO;
+	uint32_t NbClusters=(entry->DIR_FileSize+SECTOR_MASK)>>SECTOR_SHIFT;
+	uint32_t NbExtents=0;
+	extent_t * Extents=NULL;
+	
+	if(NbClusters)
+	{
+		Extents=get_extents(Cluster, NbClusters, &NbExtents);
+		if(!Extents)
+		{
+			fprintf(stderr, "%s: broken cluster chain, skipped\n", path);
+			NbErrors++;
+			return;
+		}
+	}
+	
+	Files=xrealloc(Files, (NbFiles+1)*sizeof(export_file_t));
+	Files[NbFiles].Path=strdup(path);
+	Files[NbFiles].Size=entry->DIR_FileSize;
+	Files[NbFiles].NbExtents=NbExtents;
+	Files[NbFiles].Extents=Extents;
+	NbFiles++;
+}
+
+static void scan_dir(char const * const path, const uint32_t cluster, const uint8_t depth)
+{
+	if(depth>MAX_DIR_DEPTH)
+	{
+		fprintf(stderr, "%s: directories nested too deep, skipped\n", path);
+		NbErrors++;
+		return;
+	}
+	
+	if(mkdir(path, 0777) && errno!=EEXIST)
+	{
+		perror(path);
+		NbErrors++;
+		return;
+	}
+	
+	uint8_t Sector[FS32_SECTOR_SIZE];
+	uint32_t Cluster=cluster;
+	uint32_t NbClusters=0;
+	
+	while(valid_cluster(Cluster) && NbClusters++<TotalNbOfDataSectors)
+	{
+		if(!read_image(Sector, FS32_SECTOR_SIZE, cluster_to_sector(Cluster)))
+		{
+			fprintf(stderr, "%s: reading directory failed\n", path);
+			NbErrors++;
+			return;
+		}
+		
+		uint8_t i;
+		for(i=0; i<DIR_ENTRIES_PER_SECTOR; i++)
+		{
+			fat32_directory_entry_t const * const entry=&((fat32_directory_entry_t*)Sector)[i];
+			
+			if(entry->DIR_Name[0]==0x00) //end of directory
+				return;
+			
+			if((uint8_t)entry->DIR_Name[0]==0xE5 || entry->DIR_Name[0]=='.')
+				continue;
+			
+			if((entry->DIR_Attr&ATTR_LONG_NAME_MASK)==ATTR_LONG_NAME || (entry->DIR_Attr&ATTR_VOLUME_ID))
+				continue;
+			
+			char Name[8+1+3+1];
+			fat32_filename_to_string(entry, Name);
+			
+			char * Path=xrealloc(NULL, strlen(path)+1+sizeof(Name));
+			sprintf(Path, "%s/%s", path, Name);
+			
+			if(entry->DIR_Attr&ATTR_DIRECTORY)
+				scan_dir(Path, ((uint32_t)entry->DIR_FstClusHI<<16)|entry->DIR_FstClusLO, depth+1);
+			else
+				add_file(Path, entry);
+			
+			free(Path);
+		}
+		
+		Cluster=next_cluster(Cluster);
+	}
+}
+
+static int compare_position(void const * a, void const * b)
+{
+	export_file_t const * const fa=a;
+	export_file_t const * const fb=b;
+	uint32_t ca=fa->NbExtents?fa->Extents[0].Cluster:0;
+	uint32_t cb=fb->NbExtents?fb->Extents[0].Cluster:0;
+	
+	return (ca>cb)-(ca<cb);
+}
+
+static bool copy_file(export_file_t const * const file, uint8_t * const buffer)
+{
+	int out=open(file->Path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if(out<0)
+	{
+		perror(file->Path);
+		return false;
+	}
+	
+	uint32_t Remaining=file->Size;
+	uint32_t i;
+	
+	for(i=0; i<file->NbExtents && Remaining; i++)
+	{
+		uint64_t Sector=cluster_to_sector(file->Extents[i].Cluster);
+		uint64_t NbBytesExtent=(uint64_t)file->Extents[i].NbClusters*FS32_SECTOR_SIZE;
+		
+		while(NbBytesExtent && Remaining)
+		{
+			uint32_t NbBytes=NbBytesExtent>COPY_CHUNK_BYTES?COPY_CHUNK_BYTES:NbBytesExtent;
+			
+			if(!read_image(buffer, NbBytes, Sector))
+			{
+				fprintf(stderr, "%s: reading image failed\n", file->Path);
+				close(out);
+				return false;
+			}
+			
+			if(NbBytes>Remaining)
+				NbBytes=Remaining; //end of the last sector is not part of the file
+			
+			if(write(out, buffer, NbBytes)!=(ssize_t)NbBytes)
+			{
+				perror(file->Path);
+				close(out);
+				return false;
+			}
+			
+			Sector+=NbBytes>>SECTOR_SHIFT;
+			NbBytesExtent-=NbBytes;
+			Remaining-=NbBytes;
+		}
+	}
+	
+	close(out);
+	
+	return true;
+}
+
+static void * copy_thread(void * arg)
+{
+	(void)arg;
+	uint8_t * const Buffer=xrealloc(NULL, COPY_CHUNK_BYTES);
+	
+	while(1)
+	{
+		pthread_mutex_lock(&NextFileLock);
+		uint32_t i=NextFile++;
+		pthread_mutex_unlock(&NextFileLock);
+		
+		if(i>=NbFiles)
+			break;
+		
+		bool ok=copy_file(&Files[i], Buffer);
+		
+		pthread_mutex_lock(&NextFileLock);
+		if(ok)
+			BytesCopied+=Files[i].Size;
+		else
+			NbErrors++;
+		pthread_mutex_unlock(&NextFileLock);
+	}
+	
+	free(Buffer);
+	
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static bool export_image(char const * const image, const int partition, const int nb_threads, char const * const outdir)
+{
+	if(!image_open(image, false))
+	{
+		perror(image);
+		return false;
+	}
+	
+	FS32_status_t ret;
+	uint8_t Sector[FS32_SECTOR_SIZE];
+	
+	StartOfPartition=0;
+	
+	if(partition>=0)
+	{
+#if FS32_PARTITION_SUPPORT
+		if((ret=f_set_partition(partition))!=STATUS_OK)
+		{
+			fprintf(stderr, "%s: f_set_partition failed: %d\n", image, ret);
+			image_close();
+			return false;
+		}
+		read_image(Sector, FS32_SECTOR_SIZE, 0);
+		StartOfPartition=((master_boot_record_t*)Sector)->Partitions[partition].StartSectorLBA;
+#else
+		fprintf(stderr, "partitions need FS32_PARTITION_SUPPORT set to 1 in FS32_config.h\n");
+		image_close();
+		return false;
+#endif
+	}
+	
+	if((ret=f_init())!=STATUS_OK)
+	{
+		fprintf(stderr, "%s: f_init failed: %d\n", image, ret);
+		image_close();
+		return false;
+	}
+	
+	double Start=now();
+	
+	//f_init() checked the header already
+	read_image(Sector, FS32_SECTOR_SIZE, StartOfPartition);
+	fat32_header_t const * const header=(fat32_header_t*)Sector;
+	uint32_t RsvdSecCnt=header->BPB_RsvdSecCnt;
+	uint32_t FATSz32=header->BPB_FATSz32;
+	uint32_t RootCluster=header->BPB_RootClus;
+	FirstDataSector=RsvdSecCnt+header->BPB_NumFATs*FATSz32;
+	TotalNbOfDataSectors=header->BPB_TotSec32-FirstDataSector;
+	if(TotalNbOfDataSectors+2>FATSz32*FAT_ENTRIES_PER_SECTOR)
+		TotalNbOfDataSectors=FATSz32*FAT_ENTRIES_PER_SECTOR-2;
+	
+	FAT=xrealloc(NULL, (size_t)FATSz32*FS32_SECTOR_SIZE);
+	if(!read_image(FAT, (size_t)FATSz32*FS32_SECTOR_SIZE, StartOfPartition+RsvdSecCnt))
+	{
+		fprintf(stderr, "%s: reading FAT failed\n", image);
+		free(FAT);
+		image_close();
+		return false;
+	}
+	
+	char * Name=strdup(image);
+	char * Dir=xrealloc(NULL, strlen(outdir)+1+strlen(Name)+1);
+	sprintf(Dir, "%s/%s", outdir, basename(Name));
+	
+	NbFiles=0;
+	NbErrors=0;
+	BytesCopied=0;
+	NextFile=0;
+	
+	scan_dir(Dir, RootCluster, 0);
+	
+	uint32_t NbExtents=0;
+	uint32_t i;
+	for(i=0; i<NbFiles; i++)
+		NbExtents+=Files[i].NbExtents;
+	
+	qsort(Files, NbFiles, sizeof(export_file_t), &compare_position);
+	
+	pthread_t Threads[nb_threads];
+	int t;
+	for(t=0; t<nb_threads; t++)
+	{
+		if(pthread_create(&Threads[t], NULL, &copy_thread, NULL))
+		{
+			fprintf(stderr, "creating thread failed\n");
+			exit(1);
+		}
+	}
+	for(t=0; t<nb_threads; t++)
+		pthread_join(Threads[t], NULL);
+	
+	double Seconds=now()-Start;
+	
+	printf("%s: %u file(s), %u extent(s), %llu bytes in %.3f s, %.1f MB/s%s\n", image, NbFiles, NbExtents, (unsigned long long)BytesCopied, Seconds, Seconds>0?BytesCopied/Seconds/1e6:0.0, NbErrors?", ERRORS":"");
+	
+	bool ok=!NbErrors;
+	
+	for(i=0; i<NbFiles; i++)
+	{
+		free(Files[i].Path);
+		free(Files[i].Extents);
+	}
+	free(Files);
+	Files=NULL;
+	free(FAT);
+	free(Dir);
+	free(Name);
+	image_close();
+	
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int partition=-1;
+	int nb_threads=NB_THREADS_DEFAULT;
+	char const * outdir=".";
+	
+	while((opt=getopt(argc, argv, "p:j:o:"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'p': partition=atoi(optarg); break;
+			case 'j': nb_threads=atoi(optarg); break;
+			case 'o': outdir=optarg; break;
+			default: fprintf(stderr, "usage: %s [-p partition] [-j threads] [-o outdir] image [image...]\n", argv[0]); return 1;
+		}
+	}
+	
+	if(optind>=argc || nb_threads<1)
+	{
+		fprintf(stderr, "usage: %s [-p partition] [-j threads] [-o outdir] image [image...]\n", argv[0]);
+		return 1;
+	}
+	
+	if(mkdir(outdir, 0777) && errno!=EEXIST)
+	{
+		perror(outdir);
+		return 1;
+	}
+	
+	int errors=0;
+	
+	int i;
+	for(i=optind; i<argc; i++)
+	{
+		if(!export_image(argv[i], partition, nb_threads, outdir))
+			errors++;
+	}
+	
+	return errors?1:0;
+}
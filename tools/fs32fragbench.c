@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "FS32.h"
+
+#include "FS32_config.h"
+#include "FS32_internals.h"
+
+#include "image.h"
+
+/*
+fs32fragbench - measure the fragmentation of files written at the same time on an image of a card formatted for kittenFS32
+
+Several files are created and written in turn with small random-sized f_write() like data loggers writing simultaneously. Then the layout of the files is read from the FAT and printed: number of fragments (runs of contiguous clusters), mean length of a run, how many files begin on an allocation unit (AU) boundary and how many AUs a file touches. The files are deleted at the end unless -k is given.
+
+Build it twice to compare the allocation policies, with FS32_ALLOCATION_UNIT_SECTORS set to 0 and to the AU size of your card in FS32_config.h. Build from this directory with:
+gcc -Wall -Wextra -O2 -I.. ../FS32.c image.c fs32fragbench.c -o fs32fragbench
+
+THIS WRITES TO THE IMAGE! Use a scratch image, for example:
+truncate -s 256M scratch.img && mkfs.fat -F 32 -s 1 -f 1 scratch.img
+
+usage: fs32fragbench [-p partition] [-n files] [-s KiB per file] [-w maximum bytes per write] [-a AU size in sectors for the statistics] [-k] image
+
+(c) 2021-2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#if FS32_NB_FILES_MAX<2
+#error Set FS32_NB_FILES_MAX to at least 2 in FS32_config.h to build this tool.
+#endif
+
+#define NB_FILES_DEFAULT (FS32_NB_FILES_MAX<4?FS32_NB_FILES_MAX:4)
+#define KIB_PER_FILE_DEFAULT 1024
+#define MAX_WRITE_DEFAULT 400
+
+static uint32_t * FAT;
+static uint32_t FirstDataSectorOfCard; //including the start of the partition, for the AU boundaries
+
+static void usage(char const * const name)
+{
+	fprintf(stderr, "usage: %s [-p partition] [-n files] [-s KiB per file] [-w maximum bytes per write] [-a AU size in sectors] [-k] image\n", name);
+}
+
+static void read_image(void * const data, const size_t size, const uint32_t sector)
+{
+	if(pread(image_get_fd(), data, size, (off_t)sector*FS32_SECTOR_SIZE)!=(ssize_t)size)
+	{
+		fprintf(stderr, "reading image failed\n");
+		exit(1);
+	}
+}
+
+//first cluster of a file in the root directory, 0 if not found
+static uint32_t find_first_cluster(char const * const raw_name, const uint32_t root_cluster, const uint32_t total_clusters)
+{
+	uint8_t Sector[FS32_SECTOR_SIZE];
+	uint32_t Cluster=root_cluster;
+	
+	while(Cluster>=2 && Cluster<total_clusters+2)
+	{
+		read_image(Sector, FS32_SECTOR_SIZE, FirstDataSectorOfCard+Cluster-2);
+		
+		uint8_t i;
+		for(i=0; i<DIR_ENTRIES_PER_SECTOR; i++)
+		{
+			fat32_directory_entry_t const * const entry=&((fat32_directory_entry_t*)Sector)[i];
+			if(entry->DIR_Name[0]==0x00)
+				return 0;
+			if(!memcmp(entry->DIR_Name, raw_name, 8+3))
+				return ((uint32_t)entry->DIR_FstClusHI<<16)|entry->DIR_FstClusLO;
+		}
+		
+		Cluster=FAT[Cluster]&0x0FFFFFFF;
+	}
+	
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int partition=-1;
+	uint32_t NbFiles=NB_FILES_DEFAULT;
+	uint32_t KiBPerFile=KIB_PER_FILE_DEFAULT;
+	uint32_t MaxWrite=MAX_WRITE_DEFAULT;
+	uint32_t AUSectors=FS32_ALLOCATION_UNIT_SECTORS?FS32_ALLOCATION_UNIT_SECTORS:8192;
+	bool Keep=false;
+	
+	while((opt=getopt(argc, argv, "p:n:s:w:a:k"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'p': partition=atoi(optarg); break;
+			case 'n': NbFiles=atoi(optarg); break;
+			case 's': KiBPerFile=atoi(optarg); break;
+			case 'w': MaxWrite=atoi(optarg); break;
+			case 'a': AUSectors=atoi(optarg); break;
+			case 'k': Keep=true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	
+	if(optind!=argc-1 || NbFiles<1 || NbFiles>FS32_NB_FILES_MAX || NbFiles>100 || !KiBPerFile || !MaxWrite || MaxWrite>0xFFFF || !AUSectors)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if(!image_open(argv[optind], true))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	
+	FS32_status_t ret;
+	uint8_t Sector[FS32_SECTOR_SIZE];
+	uint32_t StartOfPartition=0;
+	
+	if(partition>=0)
+	{
+#if FS32_PARTITION_SUPPORT
+		if((ret=f_set_partition(partition))!=STATUS_OK)
+		{
+			fprintf(stderr, "f_set_partition failed: %d\n", ret);
+			return 1;
+		}
+		read_image(Sector, FS32_SECTOR_SIZE, 0);
+		StartOfPartition=((master_boot_record_t*)Sector)->Partitions[partition].StartSectorLBA;
+#else
+		fprintf(stderr, "partitions need FS32_PARTITION_SUPPORT set to 1 in FS32_config.h\n");
+		return 1;
+#endif
+	}
+	
+	if((ret=f_init())!=STATUS_OK)
+	{
+		fprintf(stderr, "f_init failed: %d\n", ret);
+		return 1;
+	}
+	
+	uint8_t * const Data=malloc(MaxWrite);
+	uint8_t * const Handles=malloc(NbFiles);
+	uint32_t * const Written=calloc(NbFiles, sizeof(uint32_t));
+	if(!Data || !Handles || !Written)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	memset(Data, 0x55, MaxWrite);
+	srand(1);
+	
+	char Name[8+1+3+1];
+	uint8_t i;
+	for(i=0; i<NbFiles; i++)
+	{
+		snprintf(Name, sizeof(Name), "FRAG%02u.BIN", i);
+		if((ret=f_open(&Handles[i], Name, 'w'))!=STATUS_OK)
+		{
+			fprintf(stderr, "f_open(%s) failed: %d, delete the files of an earlier run\n", Name, ret);
+			return 1;
+		}
+	}
+	
+	//all files are written in turn until they have their size
+	uint32_t Size=KiBPerFile*1024;
+	bool Busy=true;
+	while(Busy)
+	{
+		Busy=false;
+		for(i=0; i<NbFiles; i++)
+		{
+			if(Written[i]>=Size)
+				continue;
+			uint32_t n=1+rand()%MaxWrite;
+			if(n>Size-Written[i])
+				n=Size-Written[i];
+			if((ret=f_write(Handles[i], Data, 1, n))!=STATUS_OK)
+			{
+				fprintf(stderr, "f_write failed: %d\n", ret);
+				return 1;
+			}
+			Written[i]+=n;
+			Busy=true;
+		}
+	}
+	
+	for(i=0; i<NbFiles; i++)
+		f_close(Handles[i]);
+	
+	//layout of the files from the FAT
+	read_image(Sector, FS32_SECTOR_SIZE, StartOfPartition);
+	fat32_header_t const * const header=(fat32_header_t*)Sector;
+	uint32_t RsvdSecCnt=header->BPB_RsvdSecCnt;
+	uint32_t FATSz32=header->BPB_FATSz32;
+	uint32_t RootCluster=header->BPB_RootClus;
+	FirstDataSectorOfCard=StartOfPartition+RsvdSecCnt+header->BPB_NumFATs*FATSz32;
+	uint32_t TotalClusters=FATSz32*FAT_ENTRIES_PER_SECTOR-2;
+	
+	FAT=malloc((size_t)FATSz32*FS32_SECTOR_SIZE);
+	if(!FAT)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	read_image(FAT, (size_t)FATSz32*FS32_SECTOR_SIZE, StartOfPartition+RsvdSecCnt);
+	
+	uint32_t NbClusters=0, NbFragments=0, NbAligned=0, NbAUs=0;
+	
+	for(i=0; i<NbFiles; i++)
+	{
+		char RawName[8+3+1];
+		snprintf(RawName, sizeof(RawName), "FRAG%02u  BIN", i);
+		uint32_t Cluster=find_first_cluster(RawName, RootCluster, TotalClusters);
+		uint32_t Previous=0;
+		uint32_t LastAU=0xFFFFFFFF;
+		uint32_t FileFragments=0;
+		
+		if((FirstDataSectorOfCard+Cluster-2)%AUSectors==0)
+			NbAligned++;
+		
+		while(Cluster>=2 && Cluster<TotalClusters+2)
+		{
+			NbClusters++;
+			if(Cluster!=Previous+1)
+				FileFragments++;
+			uint32_t AU=(FirstDataSectorOfCard+Cluster-2)/AUSectors;
+			if(AU!=LastAU)
+			{
+				NbAUs++;
+				LastAU=AU;
+			}
+			Previous=Cluster;
+			Cluster=FAT[Cluster]&0x0FFFFFFF;
+		}
+		
+		NbFragments+=FileFragments;
+		printf("FRAG%02u.BIN %6u fragment(s)\n", i, FileFragments);
+	}
+	
+	printf("FS32_ALLOCATION_UNIT_SECTORS=%u: %u files, %u clusters, %u fragments, mean run %.1f clusters, AU-aligned starts %u/%u, AUs per file %.2f (AU of %u sectors)\n", FS32_ALLOCATION_UNIT_SECTORS, NbFiles, NbClusters, NbFragments, NbFragments?(double)NbClusters/NbFragments:0.0, NbAligned, NbFiles, (double)NbAUs/NbFiles, AUSectors);
+	
+	if(!Keep)
+	{
+		for(i=0; i<NbFiles; i++)
+		{
+			snprintf(Name, sizeof(Name), "FRAG%02u.BIN", i);
+			f_unlink(Name);
+		}
+	}
+	
+	free(FAT);
+	free(Written);
+	free(Handles);
+	free(Data);
+	image_close();
+	
+	return 0;
+}
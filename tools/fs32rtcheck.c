@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "FS32.h"
+
+#include "FS32_config.h"
+
+#include "image.h"
+
+/*
+fs32rtcheck - check the maximum number of sector IO of f_write() in FS32_REALTIME_WRITE-mode on an image of a card formatted for kittenFS32
+
+The free space of the image is fragmented first by writing many small files and deleting every other one. Then a new file is written, another one is appended to and finally modified, each with random-sized f_write() and a call of f_idle_step() before every write. The sector reads and writes of each f_write() are counted and must not exceed FS32_RT_WRITE_MAX_IO(). The worst case of each mode is printed, the exit code is 1 if the bound was exceeded. All files are deleted at the end unless -k is given.
+
+Needs FS32_REALTIME_WRITE (and so FS32_IDLE_STEP_SUPPORT) set to 1 in FS32_config.h. The IO is counted by wrapping the low-level functions, build from this directory with:
+gcc -Wall -Wextra -O2 -I.. ../FS32.c image.c fs32rtcheck.c -Wl,--wrap=sd_read_sector,--wrap=sd_write_sector -o fs32rtcheck
+
+THIS WRITES TO THE IMAGE! Use a scratch image, for example:
+truncate -s 256M scratch.img && mkfs.fat -F 32 -s 1 -f 1 scratch.img
+
+usage: fs32rtcheck [-p partition] [-f files for fragmenting] [-n writes per mode] [-w maximum bytes per write] [-b budget of f_idle_step()] [-k] image
+
+(c) 2021-2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#if !FS32_REALTIME_WRITE
+#error Set FS32_REALTIME_WRITE to 1 in FS32_config.h to build this tool.
+#endif
+
+#if FS32_NO_WRITE || FS32_NO_APPEND || FS32_NO_MODIFY || FS32_NO_UNLINK
+#error This tool needs writing, appending, modifying and deleting files, set FS32_NO_WRITE, FS32_NO_APPEND, FS32_NO_MODIFY and FS32_NO_UNLINK to 0 in FS32_config.h.
+#endif
+
+#if FS32_MULTI_BLOCK_READ || FS32_MULTI_BLOCK_WRITE
+#error The IO of multi block transfers is not counted, set FS32_MULTI_BLOCK_READ and FS32_MULTI_BLOCK_WRITE to 0 in FS32_config.h.
+#endif
+
+#define NB_FRAGMENT_FILES_DEFAULT 2000
+#define NB_WRITES_DEFAULT 3000
+#define MAX_WRITE_DEFAULT 1500
+#define IDLE_BUDGET_DEFAULT 40
+
+static uint32_t NbIO;
+
+void __real_sd_read_sector(const uint32_t sector, uint8_t * const data);
+void __real_sd_write_sector(const uint32_t sector, uint8_t const * const data);
+
+void __wrap_sd_read_sector(const uint32_t sector, uint8_t * const data)
+{
+	NbIO++;
+	__real_sd_read_sector(sector, data);
+}
+
+void __wrap_sd_write_sector(const uint32_t sector, uint8_t const * const data)
+{
+	NbIO++;
+	__real_sd_write_sector(sector, data);
+}
+
+static void usage(char const * const name)
+{
+	fprintf(stderr, "usage: %s [-p partition] [-f files for fragmenting] [-n writes per mode] [-w maximum bytes per write] [-b budget of f_idle_step()] [-k] image\n", name);
+}
+
+static void check(FS32_status_t ret, char const * const what)
+{
+	if(ret!=STATUS_OK)
+	{
+		fprintf(stderr, "%s failed: %d\n", what, ret);
+		exit(1);
+	}
+}
+
+//returns false if the bound was exceeded
+static bool check_writes(char const * const filename, const char mode, const uint32_t nb_writes, const uint16_t max_write, const uint16_t budget, uint8_t const * const data)
+{
+	uint8_t filenr;
+	uint32_t WorstIO=0, WorstBytes=0;
+	int32_t WorstSlack=INT32_MIN;
+	uint32_t NbExceeded=0;
+	uint32_t i;
+	
+	check(f_open(&filenr, filename, mode), "f_open");
+	
+	for(i=0; i<nb_writes; i++)
+	{
+		uint16_t n=1+rand()%max_write;
+		
+		f_idle_step(budget);
+		
+		NbIO=0;
+		FS32_status_t ret=f_write(filenr, data, 1, n);
+		if(ret==WRITE_RT_NO_CACHED_CLUSTER)
+		{
+			fprintf(stderr, "f_write: no free cluster cached, use a bigger budget (-b) or smaller writes (-w)\n");
+			exit(1);
+		}
+		check(ret, "f_write");
+		
+		if(NbIO>WorstIO)
+		{
+			WorstIO=NbIO;
+			WorstBytes=n;
+		}
+		uint32_t MaxIO=FS32_RT_WRITE_MAX_IO(n);
+		if((int32_t)NbIO-(int32_t)MaxIO>WorstSlack)
+			WorstSlack=(int32_t)NbIO-(int32_t)MaxIO;
+		if(NbIO>MaxIO)
+		{
+			if(!NbExceeded)
+				fprintf(stderr, "%s ('%c'): f_write() of %u bytes did %u IO, maximum is %u\n", filename, mode, n, NbIO, MaxIO);
+			NbExceeded++;
+		}
+	}
+	
+	check(f_close(filenr), "f_close");
+	
+	printf("'%c': %u writes, worst %u IO (for %u bytes), smallest margin to the bound %d IO, %u over the bound\n", mode, nb_writes, WorstIO, WorstBytes, -WorstSlack, NbExceeded);
+	
+	return NbExceeded==0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int partition=-1;
+	uint16_t NbFragmentFiles=NB_FRAGMENT_FILES_DEFAULT;
+	uint32_t NbWrites=NB_WRITES_DEFAULT;
+	uint32_t MaxWrite=MAX_WRITE_DEFAULT;
+	uint16_t Budget=IDLE_BUDGET_DEFAULT;
+	bool Keep=false;
+	
+	while((opt=getopt(argc, argv, "p:f:n:w:b:k"))!=-1)
+	{
+		switch(opt)
+		{
+			case 'p': partition=atoi(optarg); break;
+			case 'f': NbFragmentFiles=atoi(optarg); break;
+			case 'n': NbWrites=atoi(optarg); break;
+			case 'w': MaxWrite=atoi(optarg); break;
+			case 'b': Budget=atoi(optarg); break;
+			case 'k': Keep=true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	
+	if(optind!=argc-1 || !MaxWrite || MaxWrite>0xFFFF || !Budget)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if(!image_open(argv[optind], true))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	
+	if(partition>=0)
+	{
+#if FS32_PARTITION_SUPPORT
+		check(f_set_partition(partition), "f_set_partition");
+#else
+		fprintf(stderr, "partitions need FS32_PARTITION_SUPPORT set to 1 in FS32_config.h\n");
+		return 1;
+#endif
+	}
+	
+	check(f_init(), "f_init");
+	
+	uint8_t * const Data=malloc(0xFFFF);
+	if(!Data)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	srand(1);
+	uint32_t i;
+	for(i=0; i<0xFFFF; i++)
+		Data[i]=rand();
+	
+	//fragment the free space: small files of 1 to 3 sectors, every other one is deleted
+	uint8_t filenr;
+	char Name[8+1+3+1];
+	uint16_t f;
+	for(f=0; f<NbFragmentFiles; f++)
+	{
+		snprintf(Name, sizeof(Name), "RT%05u.TMP", f);
+		f_idle_step(Budget);
+		check(f_open(&filenr, Name, 'w'), "f_open");
+		f_idle_step(Budget);
+		check(f_write(filenr, Data, 1, (f%3+1)*FS32_SECTOR_SIZE), "f_write");
+		check(f_close(filenr), "f_close");
+	}
+	for(f=1; f<NbFragmentFiles; f+=2)
+	{
+		snprintf(Name, sizeof(Name), "RT%05u.TMP", f);
+		check(f_unlink(Name), "f_unlink");
+	}
+	
+	//the file for 'a' and 'm' must exist
+	check(f_open(&filenr, "RTAPPEND.BIN", 'w'), "f_open");
+	check(f_close(filenr), "f_close");
+	
+	bool OK=true;
+	OK&=check_writes("RTNEW.BIN", 'w', NbWrites, MaxWrite, Budget, Data);
+	OK&=check_writes("RTAPPEND.BIN", 'a', NbWrites, MaxWrite, Budget, Data);
+	OK&=check_writes("RTAPPEND.BIN", 'm', NbWrites, MaxWrite, Budget, Data);
+	
+	if(!Keep)
+	{
+		check(f_unlink("RTNEW.BIN"), "f_unlink");
+		check(f_unlink("RTAPPEND.BIN"), "f_unlink");
+		for(f=0; f<NbFragmentFiles; f+=2)
+		{
+			snprintf(Name, sizeof(Name), "RT%05u.TMP", f);
+			check(f_unlink(Name), "f_unlink");
+		}
+	}
+	
+	free(Data);
+	image_close();
+	
+	printf(OK?"OK, FS32_RT_WRITE_MAX_IO() was respected\n":"FAILED, FS32_RT_WRITE_MAX_IO() was exceeded\n");
+	
+	return OK?0:1;
+}
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FS32_config.h"
+
+#include "image.h"
+
+/*
+Disk image backend for the host tools of kittenFS32
+
+IO-errors are fatal, as recommended for the low-level functions on a microcontroller.
+
+(c) 2021-2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+static int fd=-1;
+
+#if FS32_MULTI_BLOCK_READ
+static uint32_t MultipleSectorsPos;
+#endif
+
+#if FS32_MULTI_BLOCK_WRITE
+static uint32_t MultipleSectorsWritePos;
+#endif
+
+bool image_open(char const * const path, const bool writable)
+{
+	fd=open(path, writable?O_RDWR:O_RDONLY);
+	
+	return fd>=0;
+}
+
+void image_close(void)
+{
+	if(fd>=0)
+		close(fd);
+	fd=-1;
+}
+
+int image_get_fd(void)
+{
+	return fd;
+}
+
+void sd_read_sector(const uint32_t sector, uint8_t * const data)
+{
+	if(pread(fd, data, FS32_SECTOR_SIZE, (off_t)sector*FS32_SECTOR_SIZE)!=FS32_SECTOR_SIZE)
+	{
+		fprintf(stderr, "reading sector %u of image failed\n", sector);
+		exit(1);
+	}
+}
+
+void sd_write_sector(const uint32_t sector, uint8_t const * const data)
+{
+	if(pwrite(fd, data, FS32_SECTOR_SIZE, (off_t)sector*FS32_SECTOR_SIZE)!=FS32_SECTOR_SIZE)
+	{
+		fprintf(stderr, "writing sector %u of image failed\n", sector);
+		exit(1);
+	}
+}
+
+#if FS32_MULTI_BLOCK_READ
+void sd_read_multiple_sectors_start(const uint32_t sector)
+{
+	MultipleSectorsPos=sector;
+}
+
+void sd_read_multiple_sectors_next(uint8_t * const data)
+{
+	sd_read_sector(MultipleSectorsPos++, data);
+}
+
+void sd_read_multiple_sectors_stop(void)
+{
+}
+#endif
+
+#if FS32_MULTI_BLOCK_WRITE
+void sd_write_multiple_sectors_start(const uint32_t sector)
+{
+	MultipleSectorsWritePos=sector;
+}
+
+void sd_write_multiple_sectors_next(uint8_t const * const data)
+{
+	sd_write_sector(MultipleSectorsWritePos++, data);
+}
+
+void sd_write_multiple_sectors_stop(void)
+{
+}
+#endif
+
+#if FS32_DISCARD_SUPPORT
+void sd_discard_sectors(const uint32_t sector, const uint32_t count)
+{
+	//keeps the image sparse, failing is harmless (filesystem without hole punching)
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)sector*FS32_SECTOR_SIZE, (off_t)count*FS32_SECTOR_SIZE);
+}
+#endif
+
+uint16_t rtc_get_encoded_date(void)
+{
+	time_t t=time(NULL);
+	struct tm *tm=localtime(&t);
+	
+	return ((uint16_t)((tm->tm_year-80)&0x7F)<<9)|(((tm->tm_mon+1)&0x0F)<<5)|((tm->tm_mday&0x1F)<<0);
+}
+
+uint16_t rtc_get_encoded_time(void)
+{
+	time_t t=time(NULL);
+	struct tm *tm=localtime(&t);
+	
+	return ((uint16_t)(tm->tm_hour&0x1F)<<11)|((tm->tm_min&0x3F)<<5)|(((tm->tm_sec/2)&0x1F)<<0);
+}
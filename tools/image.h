@@ -0,0 +1,21 @@
+#ifndef __FS32_IMAGE_H__
+#define __FS32_IMAGE_H__
+
+/*
+Disk image backend for the host tools of kittenFS32
+
+Provides the low-level functions needed by FS32.c (sd_read_sector(), sd_write_sector(), ...) for an image file of a card or partition instead of a real SD-card.
+
+(c) 2021-2022 by kittennbfive
+
+AGPLv3+ and NO WARRANTY!
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool image_open(char const * const path, const bool writable);
+void image_close(void);
+int image_get_fd(void);
+
+#endif